@@ -0,0 +1,414 @@
+#include <sys/mman.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+Bool textlocale;
+
+uint64_t
+hashdata(uint64_t h, void const *data, size_t size)
+{
+	unsigned char const *p = data;
+
+	/* FNV-1a, which can be computed as the chunks arrive */
+	while (size-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+void
+freedata(void *data, size_t size, int fd)
+{
+	ctrlsel_cancel(data);   /* requestors still being sent it */
+	if (fd == -1) {
+		pool_put(data, size);
+		return;
+	}
+	if (data != NULL)
+		(void)munmap(data, size);
+	(void)close(fd);
+}
+
+static void *
+copydata(void *data, size_t size)
+{
+	size_t cap = size;
+	void *p;
+
+	/* move data allocated by Xlib into the pool */
+	if ((p = pool_get(&cap)) != NULL)
+		memcpy(p, data, size);
+	XFree(data);
+	return p;
+}
+
+struct clipboard *
+newclipboard(size_t ntargets)
+{
+	struct clipboard *clip;
+	size_t size, each;
+
+	/*
+	 * A clipboard and its arrays are a single block from the pool,
+	 * largest members first so none of them needs padding.
+	 */
+	each = sizeof(*clip->payloads) + sizeof(*clip->contents) +
+	       sizeof(*clip->links) + sizeof(*clip->targets);
+	if (ntargets > (SIZE_MAX - sizeof(*clip)) / each)
+		return NULL;
+	size = sizeof(*clip) + ntargets * each;
+	if ((clip = pool_get(&size)) == NULL)
+		return NULL;
+	memset(clip, 0, size);
+	*clip = (struct clipboard){
+		.payloads = (void *)(clip + 1),
+		.utf8 = None,
+		.owner = None,
+		.size = size,
+	};
+	clip->contents = (void *)(clip->payloads + ntargets);
+	clip->links = (void *)(clip->contents + ntargets);
+	clip->targets = (void *)(clip->links + ntargets);
+	for (size_t i = 0; i < ntargets; i++) {
+		clip->contents[i] = (struct ctrlsel){ .data = NULL };
+		clip->links[i] = 0;
+	}
+	return clip;
+}
+
+void *
+addpayload(struct clipboard *clip, void *data, size_t size, uint64_t hash, int fd)
+{
+	struct payload *payload;
+
+	/*
+	 * Most owners convert into several text targets the very
+	 * same bytes; keep a single copy of each distinct payload.
+	 */
+	for (size_t k = 0; k < clip->npayloads; k++) {
+		payload = &clip->payloads[k];
+		if (payload->hash != hash || payload->size != size)
+			continue;
+		if (payload->data == NULL)
+			continue;       /* compressed */
+		if (memcmp(payload->data, data, size) != 0)
+			continue;
+		freedata(data, size, fd);
+		return payload->data;
+	}
+	clip->payloads[clip->npayloads++] = (struct payload){
+		.data = data,
+		.size = size,
+		.hash = hash,
+		.fd = fd,
+		.used = getmillis(),
+	};
+	clip->nbytes += size;
+	return data;
+}
+
+static size_t
+slot(struct clipboard *clip, Atom target)
+{
+	/* Fibonacci hashing; atoms are small consecutive numbers */
+	return (target * 0x9E3779B97F4A7C15ULL >> 32) & (clip->nslots - 1);
+}
+
+static void
+reindex(struct clipboard *clip)
+{
+	size_t k, size;
+
+	/*
+	 * Index the targets in an open-addressed table at most half
+	 * full, built once per clipboard, so requests do not scan the
+	 * target list.  A slot holds a target index plus one.
+	 */
+	for (clip->nslots = 8; clip->nslots < 2 * clip->ntargets; )
+		clip->nslots *= 2;
+	size = clip->nslots * sizeof(*clip->slots);
+	if ((clip->slots = pool_get(&size)) == NULL)
+		return;
+	for (k = 0; k < clip->nslots; k++)
+		clip->slots[k] = 0;
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		k = slot(clip, clip->targets[i]);
+		while (clip->slots[k] != 0)
+			k = (k + 1) & (clip->nslots - 1);
+		clip->slots[k] = i + 1;
+	}
+}
+
+static size_t
+search(struct clipboard *clip, Atom target)
+{
+	size_t i, k;
+
+	if (clip->slots == NULL)
+		reindex(clip);
+	if (clip->slots == NULL) {
+		for (i = 0; i < clip->ntargets; i++)
+			if (clip->targets[i] == target)
+				break;
+		return i;
+	}
+	for (k = slot(clip, target); clip->slots[k] != 0; k = (k + 1) & (clip->nslots - 1)) {
+		i = clip->slots[k] - 1;
+		if (clip->targets[i] == target)
+			return i;
+	}
+	return clip->ntargets;
+}
+
+Bool
+ismeta(Atom target)
+{
+	static Bool const metatab[NATOMS] = { ATOMS(META) };
+
+	for (size_t k = 0; k < NATOMS; k++)
+		if (metatab[k] && target == atomtab[k])
+			return True;
+	return False;
+}
+
+Bool
+isderived(Atom target)
+{
+	/* compound text can only be built in a locale Xlib supports */
+	if (target == atomtab[TEXT] || target == atomtab[COMPOUND_TEXT])
+		return textlocale;
+	return target == atomtab[STRING];
+}
+
+Bool
+isessential(Atom target)
+{
+	/* the text targets, which are what is pasted most of the time */
+	return target == atomtab[UTF8_STRING] ||
+	       target == atomtab[TEXT_PLAIN_UTF8] ||
+	       target == atomtab[TEXT_PLAIN] ||
+	       isderived(target);
+}
+
+static char *
+latin1(unsigned char const *s, size_t len, size_t *n)
+{
+	unsigned char c;
+	char *buf;
+	size_t i, size = len;
+
+	/* ISO-8859-1 is the first 256 code points of Unicode */
+	if ((buf = pool_get(&size)) == NULL)
+		return NULL;
+	for (i = *n = 0; i < len; ) {
+		c = s[i++];
+		if (c < 0x80) {
+			buf[(*n)++] = c;
+		} else if ((c == 0xC2 || c == 0xC3) && i < len &&
+		           (s[i] & 0xC0) == 0x80) {
+			buf[(*n)++] = ((c & 0x1F) << 6) | (s[i++] & 0x3F);
+		} else {
+			while (i < len && (s[i] & 0xC0) == 0x80)
+				i++;
+			buf[(*n)++] = '?';
+		}
+	}
+	return buf;
+}
+
+static Bool
+derive(struct clipboard *clip, size_t i)
+{
+	struct ctrlsel *source = NULL;
+	XTextProperty prop;
+	Atom target = clip->targets[i];
+	char *text;
+	size_t k, n;
+
+	if ((k = search(clip, clip->utf8)) < clip->ntargets &&
+	    (clip->links[k] == 0 || pack_thaw(clip, clip->links[k] - 1)))
+		source = &clip->contents[k];
+	if (source == NULL || source->data == NULL || source->format != 8)
+		return False;
+
+	/*
+	 * Legacy text targets are not fetched from the owner, but
+	 * converted from its UTF-8 text when first requested.
+	 */
+	prop.value = NULL;
+	if (target != atomtab[STRING] &&
+	    (text = malloc(source->length + 1)) != NULL) {
+		memcpy(text, source->data, source->length);
+		text[source->length] = '\0';
+		if (Xutf8TextListToTextProperty(
+			display, &text, 1,
+			target == atomtab[TEXT] ? XStdICCTextStyle : XCompoundTextStyle,
+			&prop
+		) != Success) {
+			/* some characters could not be converted */
+			XFree(prop.value);
+			prop.value = NULL;
+		}
+		free(text);
+		if (prop.value != NULL &&
+		    (prop.value = copydata(prop.value, prop.nitems)) == NULL)
+			return False;
+	}
+	if (prop.value == NULL && target == atomtab[COMPOUND_TEXT])
+		return False;
+	if (prop.value == NULL) {
+		/* STRING, or TEXT when the locale cannot do better */
+		prop.value = (void *)latin1(source->data, source->length, &n);
+		if (prop.value == NULL)
+			return False;
+		prop.nitems = n;
+		prop.encoding = atomtab[STRING];
+		prop.format = 8;
+	}
+	clip->contents[i] = (struct ctrlsel){
+		.data = addpayload(
+			clip, prop.value, prop.nitems,
+			hashdata(HASHINIT, prop.value, prop.nitems), -1
+		),
+		.length = prop.nitems,
+		.type = prop.encoding,
+		.format = prop.format,
+	};
+	return True;
+}
+
+void
+dropdeferred(struct clipboard *clip)
+{
+	size_t n = 0;
+
+	if (clip == NULL || clip->owner == None)
+		return;
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		if (clip->contents[i].data == NULL &&
+		    (clip->utf8 == None || !isderived(clip->targets[i])))
+			continue;
+		clip->targets[n] = clip->targets[i];
+		clip->contents[n] = clip->contents[i];
+		n++;
+	}
+	clip->ntargets = n;
+	clip->owner = None;
+	pool_put(clip->slots, clip->nslots * sizeof(*clip->slots));
+	clip->slots = NULL;
+}
+
+Bool
+isdeferred(struct clipboard *clip, Atom target)
+{
+	size_t i;
+
+	/* left with the owner, and not fetched yet */
+	if (clip->owner == None)
+		return False;
+	if ((i = search(clip, target)) == clip->ntargets)
+		return False;
+	if (clip->contents[i].data != NULL)
+		return False;
+	return clip->utf8 == None || !isderived(target);
+}
+
+Bool
+takedeferred(struct clipboard *clip, struct clipboard *fetched,
+		Atom const *tried, size_t ntried)
+{
+	struct payload *payload;
+	struct ctrlsel *content;
+	void *data, *old;
+	size_t i, k, n = 0;
+
+	/*
+	 * Deferred targets fetched on request are moved over, payloads
+	 * and all; those the owner could not convert are dropped, so
+	 * they are not asked for again.  Return whether any was.
+	 */
+	for (k = 0; fetched != NULL && k < fetched->npayloads; k++) {
+		payload = &fetched->payloads[k];
+		if ((old = payload->data) == NULL)
+			continue;
+		data = addpayload(
+			clip, payload->data, payload->size,
+			payload->hash, payload->fd
+		);
+		for (size_t j = 0; j < fetched->ntargets; j++) {
+			content = &fetched->contents[j];
+			if (content->data != old)
+				continue;
+			if ((i = search(clip, fetched->targets[j])) < clip->ntargets &&
+			    clip->contents[i].data == NULL) {
+				clip->contents[i] = *content;
+				clip->contents[i].data = data;
+			}
+			content->data = NULL;
+		}
+		*payload = (struct payload){ .data = NULL, .fd = -1 };
+	}
+	for (i = 0; i < clip->ntargets; i++) {
+		for (k = 0; k < ntried; k++)
+			if (tried[k] == clip->targets[i])
+				break;
+		if (k < ntried && isdeferred(clip, clip->targets[i]))
+			continue;
+		clip->targets[n] = clip->targets[i];
+		clip->contents[n] = clip->contents[i];
+		n++;
+	}
+	if (n == clip->ntargets)
+		return False;
+	clip->ntargets = n;
+	pool_put(clip->slots, clip->nslots * sizeof(*clip->slots));
+	clip->slots = NULL;
+	return True;
+}
+
+Bool
+lookupcontent(struct clipboard *clip, Atom target, struct ctrlsel *content)
+{
+	size_t i;
+
+	if ((i = search(clip, target)) == clip->ntargets)
+		return False;
+	if (clip->links[i] != 0 && !pack_thaw(clip, clip->links[i] - 1))
+		return False;
+	if (clip->contents[i].data == NULL &&
+	    (!isderived(target) || !derive(clip, i)))
+		return False;
+	pack_touch(clip, clip->contents[i].data);
+	*content = clip->contents[i];
+	return True;
+}
+
+void
+freeclipboard(struct clipboard *clip)
+{
+	if (clip == NULL)
+		return;
+	for (size_t i = 0; i < clip->npayloads; i++) {
+		freedata(
+			clip->payloads[i].data,
+			clip->payloads[i].size,
+			clip->payloads[i].fd
+		);
+		pool_put(clip->payloads[i].packed, clip->payloads[i].packedsize);
+	}
+	pool_put(clip->slots, clip->nslots * sizeof(*clip->slots));
+	pool_put(clip, clip->size);
+}
@@ -7,6 +7,7 @@
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/Xlibint.h>     /* XESetCloseDisplay */
 
 #include <control/selection.h>
 
@@ -45,28 +46,100 @@ enum atoms {
 	NATOMS
 };
 
-static Atom atomtab[NATOMS];
-static ssize_t max_payload_size;
+struct context {
+	/*
+	 * Atoms and limits differ from server to server, so they are
+	 * kept for each display, and dropped when it is closed.
+	 */
+	struct context *next;
+	Display *display;
+	Atom atomtab[NATOMS];
+	ssize_t max_payload_size;
+};
 
-static void
+struct transfer {
+	/*
+	 * Content too large for a single request is sent in chunks,
+	 * each one when the requestor deletes the previous one, read
+	 * straight from the data the callback has given.
+	 */
+	struct transfer *next;
+	Display *display;
+	Window requestor;
+	Atom property;
+	Atom type;
+	int format;
+	char const *data;
+	size_t length;          /* in elements of the format */
+	size_t offset;          /* of the next chunk */
+	size_t chunk;           /* elements sent in each chunk */
+	long mask;              /* requestor's events selected before */
+};
+
+static struct context *contexts;
+static struct transfer *transfers;
+
+static int
+closecontext(Display *display, XExtCodes *codes)
+{
+	struct context **p, *ctx;
+	struct transfer **t = &transfers, *transfer;
+
+	(void)codes;
+	while (*t != NULL) {
+		if ((*t)->display == display) {
+			transfer = *t;
+			*t = transfer->next;
+			free(transfer);
+		} else {
+			t = &(*t)->next;
+		}
+	}
+	for (p = &contexts; *p != NULL; p = &(*p)->next) {
+		if ((*p)->display == display) {
+			ctx = *p;
+			*p = ctx->next;
+			free(ctx);
+			break;
+		}
+	}
+	return 0;
+}
+
+static struct context *
 init(Display *display)
 {
 	static char *atomnames[NATOMS] = { ATOMS(NAME) };
-	static Bool done = False;
-
-	if (done)
-		return;
-	XInternAtoms(display, atomnames, NATOMS, False, atomtab);
+	struct context *ctx;
+	XExtCodes *codes;
+	ssize_t header = 28;    /* ChangeProperty header, with BIG-REQUESTS */
+
+	for (ctx = contexts; ctx != NULL; ctx = ctx->next)
+		if (ctx->display == display)
+			return ctx;
+	if ((ctx = malloc(sizeof(*ctx))) == NULL)
+		return NULL;
+	if ((codes = XAddExtension(display)) == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	(void)XESetCloseDisplay(display, codes->extension, closecontext);
+	ctx->display = display;
+	XInternAtoms(display, atomnames, NATOMS, False, ctx->atomtab);
 
 	/* compute maximum size for the payload of a ChangeProperty request */
-	if ((max_payload_size = XExtendedMaxRequestSize(display)) == 0)
-		max_payload_size = XMaxRequestSize(display);
-	if (max_payload_size < 0x1000)
-		max_payload_size = 0x1000;     /* requests are no smaller than that */
-	max_payload_size *= 4;                 /* request units are 4-byte long */
-	max_payload_size -= 24;                /* ignore ChangeProperty header */
-
-	done = True;
+	if ((ctx->max_payload_size = XExtendedMaxRequestSize(display)) == 0) {
+		ctx->max_payload_size = XMaxRequestSize(display);
+		header = 24;
+	}
+	if (ctx->max_payload_size < 0x1000)
+		ctx->max_payload_size = 0x1000;     /* requests are no smaller than that */
+	ctx->max_payload_size *= 4;                 /* request units are 4-byte long */
+	ctx->max_payload_size -= header;            /* ignore ChangeProperty header */
+
+	ctx->next = contexts;
+	contexts = ctx;
+	return ctx;
 }
 
 static int
@@ -119,14 +192,14 @@ getservertime(Display *display)
 }
 
 static int
-getcontent(Display *display, Window requestor, Atom property, struct ctrlsel *content)
+getcontent(struct context *ctx, Window requestor, Atom property, struct ctrlsel *content)
 {
 	unsigned long remain;
 	ssize_t ret;
 	int status;
 
 	status = XGetWindowProperty(
-		display, requestor, property,
+		ctx->display, requestor, property,
 		0, INT_MAX,
 		True,   /* delete property after get */
 		AnyPropertyType, &content->type, &content->format,
@@ -135,7 +208,7 @@ getcontent(Display *display, Window requestor, Atom property, struct ctrlsel *co
 	ret = 0;
 	if (status != Success)
 		ret = CTRL_ENOMEM;
-	else if (content->type == atomtab[INCR])
+	else if (content->type == ctx->atomtab[INCR])
 		ret = CTRL_EMSGSIZE;
 	else if (content->data != NULL && content->length > 0)
 		return 1;
@@ -146,7 +219,7 @@ getcontent(Display *display, Window requestor, Atom property, struct ctrlsel *co
 }
 
 static ssize_t
-getatompairs(XSelectionRequestEvent const *event, Atom **atoms)
+getatompairs(struct context *ctx, XSelectionRequestEvent const *event, Atom **atoms)
 {
 	unsigned long nitems, remain;
 	int status, format;
@@ -156,7 +229,7 @@ getatompairs(XSelectionRequestEvent const *event, Atom **atoms)
 		event->display, event->requestor, event->property,
 		0, INT_MAX,
 		True,   /* delete property after get */
-		atomtab[ATOM_PAIR], &type, &format,
+		ctx->atomtab[ATOM_PAIR], &type, &format,
 		&nitems, &remain, (void *)atoms
 	);
 	if (status == Success && format == 32 && *atoms != NULL && nitems > 0)
@@ -186,9 +259,10 @@ waitnotify(Display *display, Window window, Time timestamp,
 }
 
 static int
-getatonce(Display *display, Window requestor, Time timestamp,
+getatonce(struct context *ctx, Window requestor, Time timestamp,
 		Atom selection, Atom target, struct ctrlsel *content)
 {
+	Display *display = ctx->display;
 	XEvent event;
 
 	content->data = NULL;
@@ -211,7 +285,7 @@ getatonce(Display *display, Window requestor, Time timestamp,
 		return CTRL_ETIMEDOUT;
 	if (event.xselection.property != target)
 		return CTRL_NOERROR;    /* request not responded */
-	return getcontent(display, requestor, target, content);
+	return getcontent(ctx, requestor, target, content);
 }
 
 static int
@@ -227,8 +301,9 @@ getmembersize(int format)
 }
 
 static int
-getbyparts(Display *display, Window requestor, Atom target, struct ctrlsel *content)
+getbyparts(struct context *ctx, Window requestor, Atom target, struct ctrlsel *content)
 {
+	Display *display = ctx->display;
 	FILE *stream;
 	XEvent event;
 	char *buf;
@@ -246,7 +321,7 @@ getbyparts(Display *display, Window requestor, Atom target, struct ctrlsel *cont
 			continue;
 		if (event.xproperty.state != PropertyNewValue)
 			continue;
-		status = getcontent(display, requestor, target, content);
+		status = getcontent(ctx, requestor, target, content);
 		if (membsiz == 0) {
 			membsiz = getmembersize(content->format);
 			if (membsiz == -1) {
@@ -289,17 +364,20 @@ int
 ctrlsel_request(Display *display, Time timestamp, Atom selection,
 		Atom target, struct ctrlsel *content)
 {
+	struct context *ctx;
 	Window requestor;
 	int retval;
 
-	init(display);
+	content->data = NULL;
+	if ((ctx = init(display)) == NULL)
+		return CTRL_ENOMEM;
 	if (selection == None || target == None)
 		return CTRL_NOERROR;
 	if ((requestor = createwindow(display)) == None)
 		return CTRL_NOERROR;
-	retval = getatonce(display, requestor, timestamp, selection, target, content);
+	retval = getatonce(ctx, requestor, timestamp, selection, target, content);
 	if (retval == CTRL_EMSGSIZE)    /* message is too large */
-		retval = getbyparts(display, requestor, target, content);
+		retval = getbyparts(ctx, requestor, target, content);
 	(void)XDestroyWindow(display, requestor);
 	return retval;
 }
@@ -322,19 +400,100 @@ ctrlsel_own(Display *display, Window owner, Time timestamp, Atom selection)
 static ssize_t
 getcontentsize(struct ctrlsel *content)
 {
+	/* size on the wire, where format-32 data is not in longs */
 	if (content->data == NULL && content->length > 0)
 		return -1;
-	if (content->format == 8)
-		return content->length;
-	if (content->format == 16)
-		return content->length * sizeof(short);
-	if (content->format == 32)
-		return content->length * sizeof(long);
+	if (content->format == 8 || content->format == 16 || content->format == 32)
+		return content->length * (content->format / 8);
 	return -1;
 }
 
+static void
+endtransfer(struct transfer **p)
+{
+	struct transfer *transfer = *p;
+
+	*p = transfer->next;
+	for (struct transfer *t = transfers; t != NULL; t = t->next)
+		if (t->display == transfer->display && t->requestor == transfer->requestor)
+			goto done;
+	(void)XSelectInput(transfer->display, transfer->requestor, transfer->mask);
+done:
+	free(transfer);
+}
+
 static int
-answer(XSelectionRequestEvent const *event, Time time,
+starttransfer(struct context *ctx, XSelectionRequestEvent const *event,
+	Atom property, struct ctrlsel *content, ssize_t size)
+{
+	XWindowAttributes attr;
+	struct transfer *transfer;
+	long mask = NoEventMask;
+	Bool watched = False;
+
+	/* the events selected on the requestor are restored at the end */
+	for (transfer = transfers; transfer != NULL; transfer = transfer->next) {
+		if (transfer->display == event->display &&
+		    transfer->requestor == event->requestor) {
+			mask = transfer->mask;
+			watched = True;
+			break;
+		}
+	}
+	if (!watched) {
+		if (!XGetWindowAttributes(event->display, event->requestor, &attr))
+			return CTRL_NOERROR;    /* the requestor is gone */
+		mask = attr.your_event_mask;
+	}
+	if ((transfer = malloc(sizeof(*transfer))) == NULL)
+		return CTRL_ENOMEM;
+	*transfer = (struct transfer){
+		.next = transfers,
+		.display = event->display,
+		.requestor = event->requestor,
+		.property = property,
+		.type = content->type,
+		.format = content->format,
+		.data = content->data,
+		.length = content->length,
+		.offset = 0,
+		.chunk = ctx->max_payload_size / (content->format / 8),
+		.mask = mask,
+	};
+	transfers = transfer;
+	(void)XSelectInput(
+		event->display, event->requestor,
+		mask | PropertyChangeMask | StructureNotifyMask
+	);
+	(void)XChangeProperty(
+		event->display, event->requestor, property,
+		ctx->atomtab[INCR], 32, PropModeReplace,
+		(void *)&(long){ size }, 1
+	);
+	return CTRL_NOERROR;
+}
+
+static void
+sendchunk(struct transfer **p)
+{
+	struct transfer *transfer = *p;
+	size_t n = transfer->length - transfer->offset;
+
+	if (n > transfer->chunk)
+		n = transfer->chunk;
+	(void)XChangeProperty(
+		transfer->display, transfer->requestor, transfer->property,
+		transfer->type, transfer->format, PropModeReplace,
+		(void *)(transfer->data + transfer->offset * getmembersize(transfer->format)),
+		n
+	);
+	transfer->offset += n;
+	if (n == 0)             /* a zero-length chunk ends it */
+		endtransfer(p);
+}
+
+static int
+answer(struct context *ctx, XSelectionRequestEvent const *event, Time time,
 	Atom const targets[], size_t ntargets,
 	int (*callback)(void *, Atom, struct ctrlsel *), void *arg)
 {
@@ -352,10 +511,10 @@ answer(XSelectionRequestEvent const *event, Time time,
 		goto done;
 	if (event->time != CurrentTime && event->time < time)
 		goto done;      /* out-of-time request */
-	if (event->target == atomtab[MULTIPLE]) {
+	if (event->target == ctx->atomtab[MULTIPLE]) {
 		if (event->property == None)
 			goto done;
-		natoms = getatompairs(event, &p);
+		natoms = getatompairs(ctx, event, &p);
 		if (natoms < 0)
 			retval = CTRL_ENOMEM;
 		if (natoms <= 0)
@@ -374,13 +533,13 @@ answer(XSelectionRequestEvent const *event, Time time,
 
 		if (property == None) {
 			continue;
-		} else if (target == atomtab[TIMESTAMP]) {
+		} else if (target == ctx->atomtab[TIMESTAMP]) {
 			(void)XChangeProperty(
 				event->display, event->requestor, property,
 				XA_INTEGER, 32, PropModeReplace,
 				(void *)&time, 1
 			);
-		} else if (target == atomtab[TARGETS]) {
+		} else if (target == ctx->atomtab[TARGETS]) {
 			(void)XChangeProperty(
 				event->display, event->requestor, property,
 				XA_ATOM, 32, PropModeReplace,
@@ -390,12 +549,12 @@ answer(XSelectionRequestEvent const *event, Time time,
 				event->display, event->requestor, property,
 				XA_ATOM, 32, PropModeAppend,
 				(void *)(Atom[3]){
-					atomtab[TIMESTAMP],
-					atomtab[TARGETS],
-					atomtab[MULTIPLE],
+					ctx->atomtab[TIMESTAMP],
+					ctx->atomtab[TARGETS],
+					ctx->atomtab[MULTIPLE],
 				}, 3
 			);
-		} else if (target == atomtab[MULTIPLE] || target == None) {
+		} else if (target == ctx->atomtab[MULTIPLE] || target == None) {
 			/* unsupported target */
 			pair[PAIR_PROPERTY] = None;
 		} else if (!callback(arg, target, &content)) {
@@ -403,9 +562,10 @@ answer(XSelectionRequestEvent const *event, Time time,
 		} else if ((size = getcontentsize(&content)) == -1) {
 			retval = CTRL_EINVAL;
 			pair[PAIR_PROPERTY] = None;
-		} else if (size > max_payload_size) {
-			retval = CTRL_EMSGSIZE;
-			pair[PAIR_PROPERTY] = None;
+		} else if (size > ctx->max_payload_size) {
+			retval = starttransfer(ctx, event, property, &content, size);
+			if (retval != CTRL_NOERROR)
+				pair[PAIR_PROPERTY] = None;
 		} else {
 			(void)XChangeProperty(
 				event->display, event->requestor, property,
@@ -416,11 +576,11 @@ answer(XSelectionRequestEvent const *event, Time time,
 		}
 	}
 
-	if (event->target == atomtab[MULTIPLE]) {
+	if (event->target == ctx->atomtab[MULTIPLE]) {
 		storeat = event->property;
 		(void)XChangeProperty(
 			event->display, event->requestor, storeat,
-			atomtab[ATOM_PAIR], 32, PropModeReplace,
+			ctx->atomtab[ATOM_PAIR], 32, PropModeReplace,
 			(void *)atoms, natoms
 		);
 	} else {
@@ -454,19 +614,94 @@ seterrfun(Display *display, XErrorHandler fun)
 	return XSetErrorHandler(fun);
 }
 
+static Bool
+istransfer(struct transfer const *transfer, XEvent const *ep)
+{
+	if (transfer->display != ep->xany.display)
+		return False;
+	if (ep->type == DestroyNotify)
+		return transfer->requestor == ep->xdestroywindow.window;
+	return transfer->requestor == ep->xproperty.window &&
+	       transfer->property == ep->xproperty.atom;
+}
+
+int
+ctrlsel_send(XEvent const *ep)
+{
+	struct transfer **p;
+	XErrorHandler oldhandler;
+
+	if (ep->type == PropertyNotify && ep->xproperty.state != PropertyDelete)
+		return 0;
+	if (ep->type != PropertyNotify && ep->type != DestroyNotify)
+		return 0;
+	for (p = &transfers; *p != NULL; p = &(*p)->next)
+		if (istransfer(*p, ep))
+			break;
+	if (*p == NULL)
+		return 0;
+
+	/* the requestor may be gone by now */
+	oldhandler = seterrfun(ep->xany.display, ignoreerror);
+	if (ep->type == PropertyNotify) {
+		sendchunk(p);
+	} else while (*p != NULL) {
+		if (istransfer(*p, ep))
+			endtransfer(p);
+		else
+			p = &(*p)->next;
+	}
+	(void)seterrfun(ep->xany.display, oldhandler);
+
+	/* the destruction of a window may matter to the caller too */
+	return ep->type == PropertyNotify;
+}
+
+void
+ctrlsel_cancel(void const *data)
+{
+	struct transfer **p = &transfers;
+	XErrorHandler oldhandler;
+	Display *display;
+
+	while (*p != NULL) {
+		if ((*p)->data != data) {
+			p = &(*p)->next;
+			continue;
+		}
+		display = (*p)->display;
+		oldhandler = seterrfun(display, ignoreerror);
+		endtransfer(p);
+		(void)seterrfun(display, oldhandler);
+	}
+}
+
+int
+ctrlsel_sending(void const *data)
+{
+	int n = 0;
+
+	for (struct transfer *t = transfers; t != NULL; t = t->next)
+		if (t->data == data)
+			n++;
+	return n;
+}
+
 int
 ctrlsel_answer(XEvent const *ep, Time time,
 	Atom const targets[], size_t ntargets,
 	int (*callback)(void *, Atom, struct ctrlsel *), void *arg)
 {
+	struct context *ctx;
 	XErrorHandler oldhandler;
 	int retval;
 
 	if (ep->type != SelectionRequest)
 		return 0;
-	init(ep->xany.display);
+	if ((ctx = init(ep->xany.display)) == NULL)
+		return CTRL_ENOMEM;
 	oldhandler = seterrfun(ep->xany.display, ignoreerror);
-	retval = answer(&ep->xselectionrequest, time, targets, ntargets, callback, arg);
+	retval = answer(ctx, &ep->xselectionrequest, time, targets, ntargets, callback, arg);
 	(void)seterrfun(ep->xany.display, oldhandler);
 	return retval;
 }
@@ -38,4 +38,16 @@ int ctrlsel_answer(
 	void           *arg
 );
 
+int ctrlsel_send(
+	XEvent const   *event
+);
+
+void ctrlsel_cancel(
+	void const     *data
+);
+
+int ctrlsel_sending(
+	void const     *data
+);
+
 #endif /* _CTRLSEL_H_ */
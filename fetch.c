@@ -0,0 +1,679 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+#define TIMEOUT 1000    /* give up on a target silent for this milliseconds */
+#define LIFETIME 10000  /* give up on a clipboard not fetched in this milliseconds */
+#define SPILL   (1 << 20) /* keep targets larger than this bytes out of the heap */
+
+static size_t
+membersize(int format)
+{
+	if (format == 16)
+		return sizeof(short);
+	if (format == 32)
+		return sizeof(long);
+	return sizeof(char);
+}
+
+static size_t
+lookup(struct fetch *fetch, Atom target)
+{
+	size_t i;
+
+	for (i = 0; i < fetch->clip->ntargets; i++)
+		if (fetch->clip->targets[i] == target)
+			break;
+	return i;
+}
+
+static void
+done(struct fetch *fetch, size_t i)
+{
+	if (fetch->incoming[i].state == DONE)
+		return;
+	fetch->incoming[i].state = DONE;
+	fetch->npending--;
+}
+
+static void
+discard(struct fetch *fetch, size_t i)
+{
+	struct ctrlsel *content = &fetch->clip->contents[i];
+
+	/* what has been received of it no longer counts */
+	fetch->nbytes -= content->length * membersize(content->format);
+	pool_put(fetch->clip->contents[i].data, fetch->incoming[i].capacity);
+	fetch->clip->contents[i] = (struct ctrlsel){ .data = NULL };
+	if (fetch->incoming[i].fd != -1)
+		(void)close(fetch->incoming[i].fd);
+	fetch->incoming[i].fd = -1;
+	stats.failed++;
+	done(fetch, i);
+}
+
+static void
+finish(struct fetch *fetch, size_t i)
+{
+	struct ctrlsel *content = &fetch->clip->contents[i];
+	struct incoming *incoming = &fetch->incoming[i];
+	size_t size = content->length * membersize(content->format);
+	int fd = incoming->fd;
+
+	if (fd == -1 && size > SPILL && (fd = spillfile("xclipd")) != -1) {
+		if (writeall(fd, content->data, size) == -1) {
+			(void)close(fd);
+			fd = -1;
+		} else {
+			pool_put(content->data, incoming->capacity);
+			content->data = NULL;
+			incoming->capacity = 0;
+		}
+	}
+	if (fd != -1) {
+		/* the payload now owns the file */
+		incoming->fd = -1;
+		if ((content->data = mapfile(fd, size)) == NULL) {
+			(void)close(fd);
+			discard(fetch, i);
+			return;
+		}
+	}
+	content->data = addpayload(
+		fetch->clip, content->data, size,
+		incoming->hash, fd
+	);
+	stats_add(&stats.targetsize, size);
+	done(fetch, i);
+}
+
+static Bool
+ispending(struct fetch *fetch, size_t i)
+{
+	return fetch->incoming[i].state == CONVERTING ||
+	       fetch->incoming[i].state == RECEIVING;
+}
+
+static void
+reschedule(struct fetch *fetch)
+{
+	if (fetch->clip == NULL)
+		return;         /* still waiting for TARGETS */
+	fetch->deadline = fetch->expiry;
+	for (size_t i = 0; i < fetch->clip->ntargets; i++) {
+		if (ispending(fetch, i)) {
+			fetch->deadline = MIN(
+				fetch->deadline,
+				fetch->incoming[i].deadline
+			);
+		}
+	}
+}
+
+static void
+alive(struct fetch *fetch)
+{
+	long long deadline = getmillis() + TIMEOUT;
+
+	/*
+	 * Owners convert one target at a time, so while the owner is
+	 * answering any of them, the ones queued behind are not stalled;
+	 * only the lifetime of the clipboard bounds them then.
+	 */
+	for (size_t i = 0; i < fetch->clip->ntargets; i++)
+		if (ispending(fetch, i))
+			fetch->incoming[i].deadline = deadline;
+}
+
+static void
+convert(struct fetch *fetch, Atom target)
+{
+	/* each target is stored into a property of the same name */
+	(void)XConvertSelection(
+		display, fetch->selection,
+		target, target,
+		fetch->requestor, fetch->timestamp
+	);
+}
+
+static void
+append(struct fetch *fetch, size_t i, void *data, unsigned long length, int format)
+{
+	struct ctrlsel *content = &fetch->clip->contents[i];
+	struct incoming *incoming = &fetch->incoming[i];
+	size_t membsiz, size, chunk, capacity;
+	void *p;
+
+	if (content->format == 0)
+		content->format = format;
+	membsiz = membersize(content->format);
+	size = content->length * membsiz;
+	if (format != content->format || length > (SIZE_MAX - size) / membsiz)
+		goto error;
+	chunk = length * membsiz;
+	if (size + chunk > maxtarget || chunk > maxclipboard - fetch->nbytes)
+		goto error;     /* too large for the policy */
+	if (incoming->fd == -1 && size + chunk > SPILL &&
+	    (incoming->fd = spillfile("xclipd")) != -1) {
+		/* move what has been received so far into the file */
+		if (writeall(incoming->fd, content->data, size) == -1)
+			goto error;
+		pool_put(content->data, incoming->capacity);
+		content->data = NULL;
+		incoming->capacity = 0;
+	}
+	if (incoming->fd != -1) {
+		if (writeall(incoming->fd, data, chunk) == -1)
+			goto error;
+	} else if (size + chunk > incoming->capacity) {
+		/* the chunks go straight into a buffer from the pool */
+		capacity = MAX(incoming->capacity * 2, size + chunk);
+		if ((p = pool_get(&capacity)) == NULL)
+			goto error;
+		if (size > 0)
+			memcpy(p, content->data, size);
+		pool_put(content->data, incoming->capacity);
+		content->data = p;
+		incoming->capacity = capacity;
+	}
+	if (incoming->fd == -1)
+		memcpy((char *)content->data + size, data, chunk);
+	incoming->hash = hashdata(incoming->hash, data, chunk);
+	content->length += length;
+	fetch->nbytes += chunk;
+	XFree(data);
+	return;
+error:
+	XFree(data);
+	discard(fetch, i);
+}
+
+static void
+receive(struct fetch *fetch, size_t i)
+{
+	struct ctrlsel *content = &fetch->clip->contents[i];
+	struct incoming *incoming = &fetch->incoming[i];
+	unsigned long length, remain;
+	unsigned char *data = NULL;
+	Atom type;
+	int format;
+
+	if (XGetWindowProperty(
+		display, fetch->requestor, fetch->clip->targets[i],
+		0, INT_MAX,
+		True,   /* delete property after get */
+		AnyPropertyType, &type, &format,
+		&length, &remain, &data
+	) != Success || type == None) {
+		XFree(data);
+		discard(fetch, i);
+	} else if (incoming->state == RECEIVING && length > 0) {
+		if (content->type == None)
+			content->type = type;
+		append(fetch, i, data, length, format);
+	} else if (incoming->state == RECEIVING) {
+		/* a zero-length chunk ends the transfer */
+		XFree(data);
+		if (content->length == 0)
+			discard(fetch, i);
+		else
+			finish(fetch, i);
+	} else if (type == atomtab[INCR]) {
+		/* deleting the property has started the transfer */
+		if (format == 32 && length > 0 &&
+		    *(unsigned long *)data > maxtarget) {
+			/* the owner tells a lower bound of the size */
+			XFree(data);
+			discard(fetch, i);
+			return;
+		}
+		XFree(data);
+		incoming->state = RECEIVING;
+		stats.incr++;
+	} else if (data == NULL || length == 0) {
+		XFree(data);
+		discard(fetch, i);
+	} else {
+		/* the whole data in one chunk */
+		content->type = type;
+		append(fetch, i, data, length, format);
+		if (incoming->state != DONE)
+			finish(fetch, i);
+	}
+}
+
+static void
+receivepairs(struct fetch *fetch)
+{
+	unsigned long length, remain;
+	Atom *pairs = NULL;
+	Atom type;
+	int format;
+	size_t i;
+
+	if (XGetWindowProperty(
+		display, fetch->requestor, atomtab[MULTIPLE],
+		0, INT_MAX,
+		True,   /* delete property after get */
+		atomtab[ATOM_PAIR], &type, &format,
+		&length, &remain, (void *)&pairs
+	) != Success || format != 32 || pairs == NULL) {
+		XFree(pairs);
+		pairs = NULL;
+		length = 0;
+	}
+	for (unsigned long k = 0; k + 1 < length; k += 2) {
+		i = lookup(fetch, pairs[k]);
+		if (i == fetch->clip->ntargets)
+			continue;
+		if (fetch->incoming[i].state != CONVERTING)
+			continue;
+		if (pairs[k + 1] == None)
+			discard(fetch, i);  /* owner refused this target */
+		else
+			receive(fetch, i);
+	}
+	XFree(pairs);
+	for (i = 0; i < fetch->clip->ntargets; i++) {
+		/* targets the owner has forgotten about */
+		if (fetch->incoming[i].state == CONVERTING) {
+			discard(fetch, i);
+		}
+	}
+}
+
+static void
+convertall(struct fetch *fetch)
+{
+	struct clipboard *clip = fetch->clip;
+	long long deadline = getmillis() + TIMEOUT;
+	Atom *pairs;
+	size_t n = 0;
+
+	for (size_t i = 0; i < clip->ntargets; i++)
+		fetch->incoming[i].deadline = deadline;
+
+	if (fetch->multiple) {
+		/*
+		 * Ask for everything in a single round trip; owners
+		 * that do not support MULTIPLE get one request per
+		 * target when they refuse it (see fetch_event).
+		 */
+		pairs = calloc(clip->ntargets, 2 * sizeof(*pairs));
+		if (pairs == NULL) {
+			fetch->multiple = False;
+		} else {
+			for (size_t i = 0; i < clip->ntargets; i++) {
+				if (fetch->incoming[i].state != CONVERTING)
+					continue;
+				pairs[2*n] = pairs[2*n+1] = clip->targets[i];
+				n++;
+			}
+			(void)XChangeProperty(
+				display, fetch->requestor, atomtab[MULTIPLE],
+				atomtab[ATOM_PAIR], 32, PropModeReplace,
+				(void *)pairs, 2 * n
+			);
+			free(pairs);
+			convert(fetch, atomtab[MULTIPLE]);
+		}
+	}
+	if (!fetch->multiple) {
+		for (size_t i = 0; i < clip->ntargets; i++) {
+			if (fetch->incoming[i].state == CONVERTING) {
+				convert(fetch, clip->targets[i]);
+			}
+		}
+	}
+}
+
+static void
+begin(struct fetch *fetch, Atom *targets, size_t length)
+{
+	struct clipboard *clip = NULL;
+	uint64_t hash;
+	size_t n = 0;
+
+	/* the targets are copied into the clipboard; the caller frees them */
+	fetch->npending = 0;
+	if (targets == NULL)
+		goto error;
+	for (size_t i = 0; i < length; i++) {
+		if (targets[i] == atomtab[MULTIPLE])
+			fetch->batch = True;
+		if (ismeta(targets[i]))
+			continue;
+		targets[n++] = targets[i];
+	}
+	if ((n = policy_admit(targets, n)) == 0)
+		goto error;
+	hash = hashdata(HASHINIT, targets, n * sizeof(*targets));
+	if ((clip = newclipboard(n)) == NULL)
+		goto error;
+	memcpy(clip->targets, targets, n * sizeof(*targets));
+	targets = clip->targets;
+	clip->ntargets = n;
+	clip->targetshash = hash;
+	clip->display = display;
+	if ((fetch->incoming = calloc(n, sizeof(*fetch->incoming))) == NULL)
+		goto error;
+	for (size_t i = 0; i < n; i++) {
+		if (targets[i] == atomtab[UTF8_STRING])
+			clip->utf8 = targets[i];
+		else if (targets[i] == atomtab[TEXT_PLAIN_UTF8] && clip->utf8 == None)
+			clip->utf8 = targets[i];
+	}
+	fetch->npending = n;
+	for (size_t i = 0; i < n; i++) {
+		fetch->incoming[i].state = CONVERTING;
+		fetch->incoming[i].hash = HASHINIT;
+		fetch->incoming[i].fd = -1;
+		if (clip->utf8 != None && isderived(targets[i])) {
+			/* converted on demand from the UTF-8 text */
+			fetch->incoming[i].state = DONE;
+			fetch->npending--;
+		} else if (fetch->mode != FETCH_ALL && !isessential(targets[i])) {
+			fetch->incoming[i].state = fetch->mode == FETCH_LAZY ?
+			                           DEFERRED : DONE;
+			fetch->npending--;
+		}
+	}
+	fetch->clip = clip;
+
+	/*
+	 * Owners often set the clipboard again with the same data.
+	 * When the targets are the same as the served ones, fetch the
+	 * text alone first, and only the rest if the text differs.
+	 */
+	fetch->verifying = fetch->verifying && clip->utf8 != None &&
+	                   hash == fetch->targetshash;
+	for (size_t i = 0; fetch->verifying && i < n; i++) {
+		if (targets[i] == clip->utf8 ||
+		    fetch->incoming[i].state != CONVERTING)
+			continue;
+		fetch->incoming[i].state = HELD;
+		fetch->npending--;
+	}
+	fetch->multiple = fetch->batch && fetch->npending > 1;
+	convertall(fetch);
+	return;
+error:
+	fetch->verifying = False;
+	freeclipboard(clip);
+	free(fetch->incoming);
+	fetch->incoming = NULL;
+}
+
+static void
+receivetargets(struct fetch *fetch, Atom property)
+{
+	unsigned long length, remain;
+	Atom *targets = NULL;
+	Atom type;
+	int format;
+
+	if (property == None || XGetWindowProperty(
+		display, fetch->requestor, property,
+		0, INT_MAX,
+		True,   /* delete property after get */
+		XA_ATOM, &type, &format,
+		&length, &remain, (void *)&targets
+	) != Success || format != 32 || type != XA_ATOM) {
+		XFree(targets);
+		targets = NULL;
+		length = 0;
+	}
+	begin(fetch, targets, length);
+	XFree(targets);
+}
+
+static void
+fallback(struct fetch *fetch)
+{
+	struct clipboard *clip = fetch->clip;
+	size_t i;
+
+	/*
+	 * Without the UTF-8 text there is nothing to derive the legacy
+	 * text targets from, so they are fetched from the owner too.
+	 */
+	if (clip->utf8 == None)
+		return;
+	i = lookup(fetch, clip->utf8);
+	if (fetch->incoming[i].state != DONE || clip->contents[i].data != NULL)
+		return;
+	clip->utf8 = None;
+	for (i = 0; i < clip->ntargets; i++) {
+		if (!isderived(clip->targets[i]))
+			continue;
+		if (fetch->verifying) {
+			/* released along with the others */
+			fetch->incoming[i].state = HELD;
+			continue;
+		}
+		fetch->incoming[i].state = CONVERTING;
+		fetch->incoming[i].deadline = getmillis() + TIMEOUT;
+		fetch->npending++;
+		convert(fetch, clip->targets[i]);
+	}
+}
+
+static void
+verify(struct fetch *fetch)
+{
+	struct clipboard *clip = fetch->clip;
+	size_t i, n = 0;
+
+	i = lookup(fetch, clip->utf8);
+	if (i < clip->ntargets && fetch->incoming[i].state != DONE)
+		return;
+	fetch->verifying = False;
+	if (i < clip->ntargets && clip->contents[i].data != NULL &&
+	    fetch->incoming[i].hash == fetch->texthash) {
+		fetch->unchanged = True;
+		return;
+	}
+	for (i = 0; i < clip->ntargets; i++) {
+		if (fetch->incoming[i].state == HELD) {
+			fetch->incoming[i].state = CONVERTING;
+			fetch->npending++;
+			n++;
+		}
+	}
+	fetch->multiple = fetch->batch && n > 1;
+	convertall(fetch);
+}
+
+static void
+prepare(struct fetch *fetch, Atom selection, Time timestamp,
+		enum fetchmode mode, struct clipboard const *served)
+{
+	*fetch = (struct fetch){
+		.clip = NULL,
+		.incoming = NULL,
+		.selection = selection,
+		.timestamp = timestamp,
+		.mode = mode,
+		.verifying = served != NULL && served->utf8 != None,
+		.targetshash = served != NULL ? served->targetshash : 0,
+		.texthash = served != NULL ? served->texthash : 0,
+		.npending = 1,  /* the TARGETS list */
+		.deadline = getmillis() + TIMEOUT,
+		.expiry = getmillis() + LIFETIME,
+		.started = getmillis(),
+	};
+	fetch->requestor = createwindow(display);
+}
+
+void
+fetch_start(struct fetch *fetch, Atom selection, Time timestamp,
+		enum fetchmode mode, struct clipboard const *served)
+{
+	prepare(fetch, selection, timestamp, mode, served);
+	(void)XConvertSelection(
+		display, selection,
+		atomtab[TARGETS], atomtab[TARGETS],
+		fetch->requestor, timestamp
+	);
+}
+
+void
+fetch_save(struct fetch *fetch, Atom selection, Time timestamp,
+		Atom *targets, size_t ntargets)
+{
+	/* the owner has chosen the targets, so skip asking for TARGETS */
+	prepare(fetch, selection, timestamp, FETCH_ALL, NULL);
+	begin(fetch, targets, ntargets);
+}
+
+Bool
+fetch_event(struct fetch *fetch, XEvent *event)
+{
+	size_t i;
+
+	if (event->type == SelectionNotify) {
+		XSelectionEvent *xev = &event->xselection;
+
+		if (xev->requestor != fetch->requestor)
+			return False;
+		if (xev->selection != fetch->selection)
+			return True;
+		if (fetch->clip == NULL) {
+			if (xev->target == atomtab[TARGETS])
+				receivetargets(fetch, xev->property);
+		} else if (fetch->multiple && xev->target == atomtab[MULTIPLE]) {
+			fetch->multiple = False;
+			if (xev->property != None) {
+				receivepairs(fetch);
+			} else {
+				/* refused; ask for one target at a time */
+				fetch->batch = False;
+				convertall(fetch);
+			}
+		} else if ((i = lookup(fetch, xev->target)) == fetch->clip->ntargets) {
+			return True;
+		} else if (fetch->incoming[i].state != CONVERTING) {
+			return True;
+		} else if (xev->property == None) {
+			discard(fetch, i);
+		} else {
+			receive(fetch, i);
+		}
+	} else if (event->type == PropertyNotify) {
+		XPropertyEvent *xev = &event->xproperty;
+
+		if (xev->window != fetch->requestor)
+			return False;
+		if (xev->state != PropertyNewValue || fetch->clip == NULL)
+			return True;
+		if ((i = lookup(fetch, xev->atom)) == fetch->clip->ntargets)
+			return True;
+		if (fetch->incoming[i].state != RECEIVING)
+			return True;
+		receive(fetch, i);
+	} else {
+		return False;
+	}
+	if (fetch->clip != NULL) {
+		alive(fetch);
+		fallback(fetch);
+	}
+	if (fetch->verifying)
+		verify(fetch);
+	reschedule(fetch);
+	return True;
+}
+
+size_t
+fetch_expire(struct fetch *fetch)
+{
+	long long now = getmillis();
+	size_t n = 0;
+
+	/*
+	 * Give up on the targets whose owner has been silent for too
+	 * long, or on all of them if the clipboard is taking too long
+	 * overall, so a hung owner only delays its own clipboard.
+	 */
+	if (fetch->clip == NULL) {
+		fetch->npending = 0;
+		return 0;
+	}
+	for (size_t i = 0; i < fetch->clip->ntargets; i++) {
+		if (!ispending(fetch, i))
+			continue;
+		if (fetch->incoming[i].deadline > now && fetch->expiry > now)
+			continue;
+		discard(fetch, i);
+		n++;
+	}
+	fallback(fetch);
+	if (fetch->verifying)
+		verify(fetch);
+	reschedule(fetch);
+	return n;
+}
+
+struct clipboard *
+fetch_end(struct fetch *fetch)
+{
+	struct clipboard *clip = fetch->clip;
+	Window owner = None;
+	size_t n = 0;
+
+	(void)XDestroyWindow(display, fetch->requestor);
+	fetch->requestor = None;
+	fetch->clip = NULL;
+	if (clip == NULL)
+		return NULL;
+
+	/* drop targets whose conversion failed or timed out */
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		if (ispending(fetch, i))
+			discard(fetch, i);
+		if (clip->targets[i] == clip->utf8 && clip->contents[i].data == NULL)
+			clip->utf8 = None;
+		if (clip->targets[i] == clip->utf8)
+			clip->texthash = fetch->incoming[i].hash;
+	}
+	if (fetch->unchanged) {
+		/* the served clipboard is kept instead */
+		free(fetch->incoming);
+		fetch->incoming = NULL;
+		freeclipboard(clip);
+		return NULL;
+	}
+	if (fetch->mode == FETCH_LAZY)
+		owner = XGetSelectionOwner(display, fetch->selection);
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		if (fetch->incoming[i].state == DEFERRED && owner != None) {
+			clip->owner = owner;
+			clip->acquired = fetch->timestamp;
+		}
+		else if (clip->contents[i].data == NULL &&
+		    (clip->utf8 == None || !isderived(clip->targets[i])))
+			continue;
+		clip->targets[n] = clip->targets[i];
+		clip->contents[n] = clip->contents[i];
+		n++;
+	}
+	clip->ntargets = n;
+	free(fetch->incoming);
+	fetch->incoming = NULL;
+	if (n == 0) {
+		freeclipboard(clip);
+		return NULL;
+	}
+	return clip;
+}
@@ -0,0 +1,166 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <X11/Xlib.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+enum { RECENT, CLASS };
+
+struct entry {
+	struct clipboard *clip;
+	struct entry *prev[2], *next[2];        /* links, most recent first */
+	Bool large;
+};
+
+struct list {
+	struct entry *head, *tail;
+};
+
+/*
+ * Previous clipboards live in a fixed array of entries, linked in
+ * order of use both in a list of all entries and in a list of the
+ * entries of the same size class.  When over budget, the least
+ * recently used large clipboard goes first, so a single big image
+ * does not push out a whole history of small texts.
+ */
+static struct entry *entries;
+static struct entry *unused;
+static struct list recent;
+static struct list bysize[2];
+static size_t capacity;
+static size_t budget;
+static size_t nbytes;
+
+static void
+detach(struct list *list, struct entry *e, int k)
+{
+	if (e->prev[k] != NULL)
+		e->prev[k]->next[k] = e->next[k];
+	else
+		list->head = e->next[k];
+	if (e->next[k] != NULL)
+		e->next[k]->prev[k] = e->prev[k];
+	else
+		list->tail = e->prev[k];
+	e->prev[k] = e->next[k] = NULL;
+}
+
+static void
+attach(struct list *list, struct entry *e, int k)
+{
+	e->prev[k] = NULL;
+	e->next[k] = list->head;
+	if (list->head != NULL)
+		list->head->prev[k] = e;
+	else
+		list->tail = e;
+	list->head = e;
+}
+
+static struct clipboard *
+release(struct entry *e)
+{
+	struct clipboard *clip = e->clip;
+
+	detach(&recent, e, RECENT);
+	detach(&bysize[e->large], e, CLASS);
+	nbytes -= clip->nbytes;
+	e->clip = NULL;
+	e->next[RECENT] = unused;
+	unused = e;
+	return clip;
+}
+
+void
+history_init(size_t count, size_t size)
+{
+	if (count == 0)
+		return;
+	if ((entries = calloc(count, sizeof(*entries))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	for (size_t i = 0; i < count; i++)
+		entries[i].next[RECENT] = i + 1 < count ? &entries[i + 1] : NULL;
+	unused = entries;
+	capacity = count;
+	budget = size;
+}
+
+void
+history_push(struct clipboard *clip)
+{
+	struct entry *e;
+
+	if (clip == NULL)
+		return;
+	if (capacity == 0) {
+		freeclipboard(clip);
+		return;
+	}
+	if (unused == NULL)
+		freeclipboard(release(recent.tail));
+	e = unused;
+	unused = e->next[RECENT];
+	e->clip = clip;
+	e->large = clip->nbytes > budget / capacity;
+	attach(&recent, e, RECENT);
+	attach(&bysize[e->large], e, CLASS);
+	nbytes += clip->nbytes;
+	while (nbytes > budget) {
+		if (bysize[True].tail != NULL)
+			e = bysize[True].tail;
+		else
+			e = bysize[False].tail;
+		freeclipboard(release(e));
+	}
+}
+
+size_t
+history_size(void)
+{
+	return nbytes;
+}
+
+struct clipboard *
+history_take(size_t index)
+{
+	struct entry *e;
+
+	for (e = recent.head; e != NULL && index > 0; index--)
+		e = e->next[RECENT];
+	if (e == NULL)
+		return NULL;
+	return release(e);
+}
+
+long long
+history_pack(void)
+{
+	long long timeout = -1, t;
+
+	/* previous clipboards are the coldest ones */
+	for (struct entry *e = recent.tail; e != NULL; e = e->prev[RECENT]) {
+		nbytes -= e->clip->nbytes;
+		t = pack_clipboard(e->clip);
+		nbytes += e->clip->nbytes;      /* less, if it was compressed */
+		if (t == 0)
+			return 0;
+		if (t > 0 && (timeout < 0 || t < timeout))
+			timeout = t;
+	}
+	return timeout;
+}
+
+void
+history_free(void)
+{
+	while (recent.head != NULL)
+		freeclipboard(release(recent.head));
+	free(entries);
+	entries = unused = NULL;
+	capacity = 0;
+}
@@ -0,0 +1,271 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <X11/Xlib.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+#define COLD    10000   /* compress targets not read for this milliseconds */
+#define MINMATCH 4
+#define MAXOFFSET 0xFFFF
+#define HASHBITS 12
+
+/*
+ * Targets on the heap that have not been read for a while are kept
+ * compressed, and decompressed again when requested.  A compressed
+ * target that is read keeps both forms until it is cold again, so
+ * it is only compressed once.  While a payload is compressed, the
+ * contents that point to it are NULL, and their link holds the
+ * index of the payload plus one.
+ *
+ * The compressed form is a sequence of literal runs and back
+ * references, each one led by a byte with the length of the run
+ * in its high half and the length of the reference less MINMATCH
+ * in its low half.  A half of 15 is followed by more bytes of
+ * length, the last of which is below 255.  A reference is a
+ * two-byte offset back into the output; the last run has none.
+ */
+size_t packsize;                /* compress targets of at least this size, if not 0 */
+
+static uint32_t
+read32(unsigned char const *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static Bool
+putlen(unsigned char *dst, size_t *op, size_t cap, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255) {
+		if (*op >= cap)
+			return False;
+		dst[(*op)++] = 255;
+	}
+	if (*op >= cap)
+		return False;
+	dst[(*op)++] = len;
+	return True;
+}
+
+static Bool
+putrun(unsigned char *dst, size_t *op, size_t cap,
+		unsigned char const *lit, size_t nlit, size_t offset, size_t len)
+{
+	size_t m = len > 0 ? len - MINMATCH : 0;
+
+	if (*op >= cap)
+		return False;
+	dst[(*op)++] = MIN(nlit, 15) << 4 | MIN(m, 15);
+	if (nlit >= 15 && !putlen(dst, op, cap, nlit))
+		return False;
+	if (nlit > cap - *op)
+		return False;
+	memcpy(dst + *op, lit, nlit);
+	*op += nlit;
+	if (len == 0)
+		return True;
+	if (cap - *op < 2)
+		return False;
+	dst[(*op)++] = offset & 0xFF;
+	dst[(*op)++] = offset >> 8;
+	return m < 15 || putlen(dst, op, cap, m);
+}
+
+static size_t
+compress(unsigned char const *src, size_t n, unsigned char *dst, size_t cap)
+{
+	static size_t table[1 << HASHBITS];     /* position plus one */
+	size_t ip = 0, anchor = 0, op = 0, ref, len;
+	uint32_t h;
+
+	/* return the compressed size, or 0 if it is not below cap */
+	memset(table, 0, sizeof(table));
+	while (ip + MINMATCH <= n) {
+		h = read32(src + ip) * 2654435761U >> (32 - HASHBITS);
+		ref = table[h];
+		table[h] = ip + 1;
+		if (ref == 0 || ip - --ref > MAXOFFSET ||
+		    read32(src + ref) != read32(src + ip)) {
+			ip++;
+			continue;
+		}
+		for (len = MINMATCH; ip + len < n && src[ref + len] == src[ip + len]; len++)
+			;
+		if (!putrun(dst, &op, cap, src + anchor, ip - anchor, ip - ref, len))
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+	if (!putrun(dst, &op, cap, src + anchor, n - anchor, 0, 0))
+		return 0;
+	return op < cap ? op : 0;
+}
+
+static Bool
+getlen(unsigned char const *src, size_t *ip, size_t n, size_t *len)
+{
+	unsigned char c;
+
+	do {
+		if (*ip >= n)
+			return False;
+		c = src[(*ip)++];
+		*len += c;
+	} while (c == 255);
+	return True;
+}
+
+static Bool
+decompress(unsigned char const *src, size_t n, unsigned char *dst, size_t size)
+{
+	size_t ip = 0, op = 0, nlit, len, offset;
+	unsigned char token;
+
+	while (ip < n) {
+		token = src[ip++];
+		nlit = token >> 4;
+		if (nlit == 15 && !getlen(src, &ip, n, &nlit))
+			return False;
+		if (nlit > n - ip || nlit > size - op)
+			return False;
+		memcpy(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == n)
+			break;
+		if (n - ip < 2)
+			return False;
+		offset = src[ip] | src[ip + 1] << 8;
+		ip += 2;
+		len = token & 0x0F;
+		if (len == 15 && !getlen(src, &ip, n, &len))
+			return False;
+		len += MINMATCH;
+		if (offset == 0 || offset > op || len > size - op)
+			return False;
+		for (; len > 0; len--, op++)
+			dst[op] = dst[op - offset];     /* may overlap */
+	}
+	return op == size;
+}
+
+static void
+freeze(struct clipboard *clip, size_t k)
+{
+	struct payload *payload = &clip->payloads[k];
+	unsigned char *scratch;
+	size_t limit, cap, n;
+
+	if (payload->packed == NULL) {
+		/* not worth it unless it saves an eighth */
+		limit = cap = payload->size - payload->size / 8;
+		if ((scratch = pool_get(&cap)) == NULL)
+			return;
+		n = compress(payload->data, payload->size, scratch, limit);
+		if (n > 0 && (payload->packed = pool_get(&(size_t){n})) != NULL) {
+			memcpy(payload->packed, scratch, n);
+			payload->packedsize = n;
+			clip->nbytes += n;
+			stats.packed++;
+		}
+		pool_put(scratch, cap);
+		if (payload->packed == NULL) {
+			payload->dense = True;
+			return;
+		}
+	}
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		if (clip->contents[i].data == payload->data) {
+			clip->contents[i].data = NULL;
+			clip->links[i] = k + 1;
+		}
+	}
+	pool_put(payload->data, payload->size);
+	payload->data = NULL;
+	clip->nbytes -= payload->size;
+}
+
+Bool
+pack_thaw(struct clipboard *clip, size_t k)
+{
+	struct payload *payload = &clip->payloads[k];
+	size_t size = payload->size;
+	void *data;
+
+	if (payload->data != NULL)
+		return True;
+	if ((data = pool_get(&size)) == NULL)
+		return False;
+	if (!decompress(payload->packed, payload->packedsize, data, payload->size)) {
+		pool_put(data, size);
+		return False;
+	}
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		if (clip->links[i] == k + 1) {
+			clip->contents[i].data = data;
+			clip->links[i] = 0;
+		}
+	}
+	payload->data = data;
+	payload->used = getmillis();
+	clip->nbytes += payload->size;
+	stats.unpacked++;
+	return True;
+}
+
+void
+pack_touch(struct clipboard *clip, void const *data)
+{
+	if (packsize == 0)
+		return;
+	for (size_t k = 0; k < clip->npayloads; k++) {
+		if (clip->payloads[k].data == data) {
+			clip->payloads[k].used = getmillis();
+			return;
+		}
+	}
+}
+
+long long
+pack_clipboard(struct clipboard *clip)
+{
+	struct payload *payload;
+	long long now = getmillis();
+	long long wait = -1, t;
+
+	/*
+	 * Compress one cold payload at a time, so requests are not kept
+	 * waiting; return how long until the next one is cold, or 0 if
+	 * one has been compressed.
+	 */
+	if (packsize == 0 || clip == NULL || clip->owner != None)
+		return -1;
+	for (size_t k = 0; k < clip->npayloads; k++) {
+		payload = &clip->payloads[k];
+		if (payload->data == NULL || payload->fd != -1 ||
+		    payload->dense || payload->size < packsize)
+			continue;
+		if ((t = payload->used + COLD - now) > 0) {
+			if (wait < 0 || t < wait)
+				wait = t;
+			continue;
+		}
+		if (ctrlsel_sending(payload->data)) {
+			/* not cold while a requestor is reading it */
+			payload->used = now;
+			if (wait < 0 || COLD < wait)
+				wait = COLD;
+			continue;
+		}
+		freeze(clip, k);
+		return 0;
+	}
+	return wait;
+}
@@ -0,0 +1,119 @@
+#include <err.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <X11/Xlib.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+struct pattern {
+	char const *glob;
+	Bool allow;
+};
+
+/*
+ * Targets are admitted by name: a target is left out when it matches
+ * a deny pattern, or when there are allow patterns and it matches
+ * none of them.  Admitted targets are then limited by size as their
+ * data arrives (see fetch.c).
+ */
+static struct pattern *patterns;
+static size_t npatterns;
+static Bool allowlist;
+
+size_t maxtarget = SIZE_MAX;
+size_t maxclipboard = SIZE_MAX;
+
+void
+policy_pattern(char const *glob, Bool allow)
+{
+	struct pattern *p;
+
+	p = realloc(patterns, (npatterns + 1) * sizeof(*patterns));
+	if (p == NULL)
+		err(EXIT_FAILURE, "realloc");
+	patterns = p;
+	patterns[npatterns++] = (struct pattern){
+		.glob = glob,
+		.allow = allow,
+	};
+	if (allow)
+		allowlist = True;
+}
+
+static Bool
+admit(char const *name)
+{
+	Bool allowed = !allowlist;
+
+	for (size_t k = 0; k < npatterns; k++) {
+		if (fnmatch(patterns[k].glob, name, 0) != 0)
+			continue;
+		if (!patterns[k].allow)
+			return False;
+		allowed = True;
+	}
+	return allowed;
+}
+
+static size_t
+filter(Atom *targets, size_t ntargets)
+{
+	char **names;
+	size_t n = 0;
+
+	if (npatterns == 0 || ntargets == 0)
+		return ntargets;
+
+	/* rather keep every target than lose the clipboard */
+	if ((names = calloc(ntargets, sizeof(*names))) == NULL) {
+		warn("calloc");
+		return ntargets;
+	}
+	if (XGetAtomNames(display, targets, ntargets, names)) {
+		for (size_t i = 0; i < ntargets; i++) {
+			if (admit(names[i])) {
+				targets[n++] = targets[i];
+			}
+		}
+	} else {
+		warnx("could not get the names of the targets");
+		n = ntargets;
+	}
+	for (size_t i = 0; i < ntargets; i++)
+		XFree(names[i]);
+	free(names);
+	return n;
+}
+
+size_t
+policy_admit(Atom *targets, size_t ntargets)
+{
+	Atom target;
+	size_t k = 0;
+
+	ntargets = filter(targets, ntargets);
+
+	/* move the text targets first, so they are converted first */
+	for (size_t i = 0; i < ntargets; i++) {
+		if (!isessential(targets[i]))
+			continue;
+		target = targets[i];
+		memmove(&targets[k + 1], &targets[k], (i - k) * sizeof(*targets));
+		targets[k++] = target;
+	}
+	return ntargets;
+}
+
+void
+policy_free(void)
+{
+	free(patterns);
+	patterns = NULL;
+	npatterns = 0;
+}
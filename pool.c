@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <X11/Xlib.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+#define MINCLASS 6      /* smallest buffer, as a power of two */
+#define MAXCLASS 20     /* largest buffer kept for reuse, as a power of two */
+#define POOLSIZE (8 << 20) /* keep up to this bytes of released buffers */
+
+/*
+ * Clipboards and their payloads on the heap are taken from buffers
+ * in power-of-two size classes.  A released buffer is kept for the
+ * next clipboards rather than freed, so a daemon running for weeks
+ * reuses the same blocks generation after generation instead of
+ * fragmenting the heap.  A buffer is released with any size of the
+ * class it has been got with; larger ones are not kept.
+ */
+struct buffer {
+	struct buffer *next;
+};
+
+static struct buffer *classes[MAXCLASS + 1];
+static size_t nbytes;
+
+static int
+classof(size_t size)
+{
+	int k;
+
+	for (k = MINCLASS; k <= MAXCLASS && size > (size_t)1 << k; k++)
+		;
+	return k;
+}
+
+void *
+pool_get(size_t *size)
+{
+	struct buffer *buf;
+	int k = classof(*size);
+
+	if (k > MAXCLASS) {
+		stats.allocated++;
+		return malloc(*size);
+	}
+	*size = (size_t)1 << k;
+	if ((buf = classes[k]) != NULL) {
+		classes[k] = buf->next;
+		nbytes -= *size;
+		return buf;
+	}
+	stats.allocated++;
+	return malloc(*size);
+}
+
+void
+pool_put(void *data, size_t size)
+{
+	struct buffer *buf = data;
+	int k = classof(size);
+
+	if (data == NULL)
+		return;
+	if (k > MAXCLASS || nbytes + ((size_t)1 << k) > POOLSIZE) {
+		free(data);
+		return;
+	}
+	buf->next = classes[k];
+	classes[k] = buf;
+	nbytes += (size_t)1 << k;
+}
+
+void
+pool_free(void)
+{
+	struct buffer *buf;
+
+	for (int k = MINCLASS; k <= MAXCLASS; k++) {
+		while ((buf = classes[k]) != NULL) {
+			classes[k] = buf->next;
+			free(buf);
+		}
+	}
+	nbytes = 0;
+}
@@ -0,0 +1,328 @@
+#if __linux__
+#define _GNU_SOURCE     /* F_GET_SEALS */
+#endif
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+#define MAXQUERY 4096   /* size of a query, in bytes */
+#define MAXNAMES 64     /* number of targets in a query */
+#define WAIT    200     /* give up on a silent client after this milliseconds */
+
+/*
+ * Local clients (see xclipout.c) can read the clipboard from us,
+ * without any X traffic.  A client connects to the socket and
+ * sends the names of the targets it wants, one per line, ending
+ * with an empty line.  We answer with the first of those we have:
+ *
+ *	"size\n" followed by the data, or
+ *	"size offset\n" with a read-only file descriptor attached,
+ *	the data being in the file at that offset.
+ *
+ * Or we just close the connection, and the client asks the X
+ * server instead.
+ *
+ * The sockets are never blocked on: each client is read from and
+ * written to as poll(2) finds it ready, alongside the X events, so a
+ * slow client delays nobody but itself.  An inline reply is copied,
+ * as the clipboard may change while it is being sent.
+ */
+struct client {
+	int fd;                 /* -1 when the slot is free */
+	size_t len;             /* of the query read so far */
+	char *reply;            /* being sent, or NULL while reading */
+	size_t size, sent;
+	long long deadline;     /* when to give up on the client */
+	char query[MAXQUERY];
+};
+
+static struct sockaddr_un addr = { .sun_family = AF_UNIX };
+static struct client clients[QUERYFDS - 1];
+static int listener = -1;
+
+static void
+drop(struct client *client)
+{
+	(void)close(client->fd);
+	free(client->reply);
+	client->fd = -1;
+	client->reply = NULL;
+	client->len = client->size = client->sent = 0;
+}
+
+static Bool
+shareable(struct payload *payload)
+{
+	int flags;
+
+	if (payload->fd == -1)
+		return False;
+	flags = fcntl(payload->fd, F_GETFL);
+	if (flags != -1 && (flags & O_ACCMODE) == O_RDONLY)
+		return True;
+#if __linux__
+	/* memfd_create(2) files cannot be written once sealed */
+	flags = fcntl(payload->fd, F_GET_SEALS);
+	if (flags != -1 && (flags & F_SEAL_WRITE))
+		return True;
+#endif
+	return False;
+}
+
+static Bool
+reply(struct client *client, struct clipboard *clip, struct ctrlsel *content)
+{
+	struct payload *payload = NULL;
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	char header[64];
+	size_t size;
+
+	for (size_t k = 0; k < clip->npayloads; k++)
+		if (clip->payloads[k].data == content->data)
+			payload = &clip->payloads[k];
+	if (payload != NULL)
+		size = payload->size;
+	else if (content->format == 32)
+		size = content->length * sizeof(long);
+	else if (content->format == 16)
+		size = content->length * sizeof(short);
+	else
+		size = content->length;
+	if (payload == NULL || !shareable(payload)) {
+		(void)snprintf(header, sizeof(header), "%zu\n", size);
+		client->size = strlen(header) + size;
+		if ((client->reply = malloc(client->size)) == NULL)
+			return False;
+		memcpy(client->reply, header, strlen(header));
+		memcpy(client->reply + strlen(header), content->data, size);
+		return True;
+	}
+
+	/* hand the file over, so the client maps the data in itself */
+	(void)snprintf(
+		header, sizeof(header), "%zu %llu\n",
+		size, (unsigned long long)payload->offset
+	);
+	msg.msg_iov = &(struct iovec){
+		.iov_base = header,
+		.iov_len = strlen(header),
+	};
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &payload->fd, sizeof(int));
+
+	/* a short message, for which a fresh socket has room */
+	(void)sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+	return False;
+}
+
+static Bool
+serve(struct client *client, struct clipboard *(*current)(void))
+{
+	struct clipboard *clip;
+	char *names[MAXNAMES];
+	Atom atoms[MAXNAMES];
+	struct ctrlsel content;
+	size_t n = 0;
+	ssize_t r;
+	char *p, *end;
+
+	/* return whether the client is still being served */
+	r = read(client->fd, client->query + client->len, MAXQUERY - client->len - 1);
+	if (r == -1 && (errno == EINTR || errno == EAGAIN))
+		return True;
+	if (r <= 0)
+		return False;
+	client->len += r;
+	client->query[client->len] = '\0';
+	if ((end = strstr(client->query, "\n\n")) == NULL)
+		return client->len + 1 < MAXQUERY;
+	end[1] = '\0';
+	for (p = client->query; n < MAXNAMES && (end = strchr(p, '\n')) != NULL; p = end + 1) {
+		*end = '\0';
+		if (*p != '\0')
+			names[n++] = p;
+	}
+	if (n == 0 || (clip = current()) == NULL)
+		return False;
+	(void)XInternAtoms(display, names, n, True, atoms);
+	for (size_t i = 0; i < n; i++) {
+		if (atoms[i] == None)
+			continue;
+		if (lookupcontent(clip, atoms[i], &content))
+			return reply(client, clip, &content);
+	}
+	return False;
+}
+
+static Bool
+sendreply(struct client *client)
+{
+	ssize_t n;
+
+	/* return whether there is still some of the reply to send */
+	n = send(
+		client->fd, client->reply + client->sent,
+		client->size - client->sent, MSG_NOSIGNAL
+	);
+	if (n == -1)
+		return errno == EINTR || errno == EAGAIN;
+	client->sent += n;
+	return client->sent < client->size;
+}
+
+int
+query_init(void)
+{
+	mode_t mask;
+
+	for (size_t i = 0; i < LEN(clients); i++)
+		clients[i] = (struct client){ .fd = -1 };
+	if (socketpath(addr.sun_path, sizeof(addr.sun_path)) == -1) {
+		warnx("could not name the socket");
+		return -1;
+	}
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("socket");
+		return -1;
+	}
+
+	/*
+	 * A socket left there is from a previous run: there cannot be
+	 * two of us on a display, as we own CLIPBOARD_MANAGER.
+	 */
+	(void)unlink(addr.sun_path);
+	mask = umask(077);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		warn("%s", addr.sun_path);
+		(void)umask(mask);
+		(void)close(listener);
+		return listener = -1;
+	}
+	(void)umask(mask);
+	if (listen(listener, SOMAXCONN) == -1 ||
+	    fcntl(listener, F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(listener, F_SETFL, O_NONBLOCK) == -1) {
+		warn("%s", addr.sun_path);
+		query_free();
+		return -1;
+	}
+	return listener;
+}
+
+long long
+query_poll(struct pollfd *pfds)
+{
+	long long now = getmillis();
+	long long timeout = -1;
+	int accepting = -1;
+
+	/*
+	 * Fill the poll set with the socket, while there is room for
+	 * another client, and the clients; return how long to wait
+	 * for the silent ones.
+	 */
+	for (size_t i = 0; i < LEN(clients); i++) {
+		pfds[i + 1] = (struct pollfd){
+			.fd = clients[i].fd,    /* ignored when -1 */
+			.events = clients[i].reply != NULL ? POLLOUT : POLLIN,
+		};
+		if (clients[i].fd == -1) {
+			accepting = listener;
+			continue;
+		}
+		if (timeout < 0 || clients[i].deadline - now < timeout)
+			timeout = MAX(clients[i].deadline - now, 0);
+	}
+	pfds[0] = (struct pollfd){
+		.fd = accepting,
+		.events = POLLIN,
+	};
+	return timeout;
+}
+
+void
+query_answer(struct pollfd const *pfds, struct clipboard *(*current)(void))
+{
+	struct client *client;
+	long long now = getmillis();
+	Bool serving;
+	int fd;
+
+	for (size_t i = 0; i < LEN(clients); i++) {
+		client = &clients[i];
+		if (client->fd == -1)
+			continue;
+		if (pfds[i + 1].fd == client->fd && pfds[i + 1].revents != 0) {
+			serving = client->reply != NULL ?
+			          sendreply(client) : serve(client, current);
+			if (!serving) {
+				drop(client);
+				continue;
+			}
+			client->deadline = now + WAIT;
+		}
+		if (client->deadline <= now)
+			drop(client);
+	}
+	if (pfds[0].fd == -1 || !(pfds[0].revents & POLLIN))
+		return;
+	for (size_t i = 0; i < LEN(clients); i++) {
+		client = &clients[i];
+		if (client->fd != -1)
+			continue;
+		if ((fd = accept(listener, NULL, NULL)) == -1)
+			break;
+		(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+		(void)fcntl(fd, F_SETFL, O_NONBLOCK);
+		client->fd = fd;
+		client->deadline = now + WAIT;
+
+		/* the query is most often there already */
+		if (!serve(client, current))
+			drop(client);
+		else if (client->reply != NULL && !sendreply(client))
+			drop(client);
+	}
+}
+
+void
+query_free(void)
+{
+	if (listener == -1)
+		return;
+	for (size_t i = 0; i < LEN(clients); i++)
+		if (clients[i].fd != -1)
+			drop(&clients[i]);
+	(void)close(listener);
+	(void)unlink(addr.sun_path);
+	listener = -1;
+}
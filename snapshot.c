@@ -0,0 +1,378 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+#define MAGIC   "xclipd\0\1"
+#define NONE    UINT32_MAX
+
+/*
+ * The snapshot file holds the served clipboard in the layout below
+ * (in host byte order, as it is only read back on the same host).
+ * Atoms are saved by name, as they may change across X sessions.
+ * Each payload begins on a page boundary, so it can be mapped back
+ * from the file as is.
+ *
+ *	struct header
+ *	struct record[ntargets]
+ *	struct extent[npayloads]
+ *	names[namesize]         NUL-terminated atom names
+ *	payloads                each one page-aligned
+ */
+struct header {
+	char magic[8];
+	uint32_t longsize;              /* format-32 data is in longs */
+	uint32_t ntargets;
+	uint32_t npayloads;
+	uint32_t namesize;
+	uint32_t utf8;                  /* name offset, or NONE */
+	uint32_t pad;
+};
+
+struct record {
+	uint64_t length;                /* in format units */
+	uint32_t payload;               /* index, or NONE if not derived yet */
+	uint32_t format;
+	uint32_t name;                  /* offsets into the names */
+	uint32_t type;
+};
+
+struct extent {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t hash;
+};
+
+static char const *path;
+static size_t pagesize;
+static pid_t writer = -1;
+static Bool stale;              /* clipboard changed while writing */
+
+static size_t
+pagealign(size_t n)
+{
+	return (n + pagesize - 1) / pagesize * pagesize;
+}
+
+static uint32_t
+payloadindex(struct clipboard *clip, void *data)
+{
+	for (uint32_t k = 0; k < clip->npayloads; k++)
+		if (clip->payloads[k].data == data)
+			return k;
+	return NONE;
+}
+
+static int
+writesnapshot(struct clipboard *clip, char *names[], size_t nnames, int fd)
+{
+	static char const zeros[512];
+	struct header header = { .magic = MAGIC };
+	struct record record;
+	struct extent extent;
+	size_t off, namesize, k, len;
+	FILE *fp;
+
+	if ((fp = fdopen(fd, "w")) == NULL)
+		return -1;
+	namesize = 0;
+	for (k = 0; k < nnames; k++)
+		namesize += strlen(names[k]) + 1;
+	header.longsize = sizeof(long);
+	header.ntargets = clip->ntargets;
+	header.npayloads = clip->npayloads;
+	header.namesize = namesize;
+	header.utf8 = NONE;
+
+	/* names are in the order snapshot_save() has got them */
+	off = k = 0;
+	if (fwrite(&header, sizeof(header), 1, fp) != 1)
+		goto error;
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		record = (struct record){
+			.length = clip->contents[i].length,
+			.format = clip->contents[i].format,
+			.payload = payloadindex(clip, clip->contents[i].data),
+			.name = off,
+			.type = NONE,
+		};
+		off += strlen(names[k++]) + 1;
+		if (clip->contents[i].type != None) {
+			record.type = off;
+			off += strlen(names[k++]) + 1;
+		}
+		(void)fwrite(&record, sizeof(record), 1, fp);
+	}
+	if (clip->utf8 != None)
+		header.utf8 = off;
+
+	off = pagealign(
+		sizeof(header) +
+		clip->ntargets * sizeof(record) +
+		clip->npayloads * sizeof(extent) +
+		namesize
+	);
+	for (k = 0; k < clip->npayloads; k++) {
+		extent = (struct extent){
+			.offset = off,
+			.size = clip->payloads[k].size,
+			.hash = clip->payloads[k].hash,
+		};
+		off = pagealign(off + extent.size);
+		(void)fwrite(&extent, sizeof(extent), 1, fp);
+	}
+	for (k = 0; k < nnames; k++)
+		(void)fwrite(names[k], 1, strlen(names[k]) + 1, fp);
+	for (k = 0; k < clip->npayloads; k++) {
+		while ((len = ftello(fp) % pagesize) != 0)
+			(void)fwrite(zeros, 1, MIN(sizeof(zeros), pagesize - len), fp);
+		(void)fwrite(clip->payloads[k].data, 1, clip->payloads[k].size, fp);
+	}
+
+	/* rewrite the header, now the utf8 offset is known */
+	if (fflush(fp) == EOF || fseeko(fp, 0, SEEK_SET) == -1)
+		goto error;
+	(void)fwrite(&header, sizeof(header), 1, fp);
+	if (fflush(fp) == EOF || ferror(fp) || fsync(fd) == -1)
+		goto error;
+	return fclose(fp);
+error:
+	(void)fclose(fp);
+	return -1;
+}
+
+void
+snapshot_init(char const *file)
+{
+	path = file;
+	pagesize = sysconf(_SC_PAGESIZE);
+}
+
+void
+snapshot_save(struct clipboard *clip)
+{
+	char tmp[PATH_MAX];
+	char **names;
+	Atom *atoms;
+	size_t n = 0;
+	int fd;
+
+	if (path == NULL || clip == NULL)
+		return;
+	if (clip->owner != None)
+		return;         /* saved when its owner is gone */
+	if (writer != -1) {
+		/* save it when the running writer is done */
+		stale = True;
+		return;
+	}
+	stale = False;
+
+	/*
+	 * Get the atom names here (a single round trip), and leave
+	 * the writing to a child process, which has its own copy of
+	 * the clipboard and does not delay answering requests.
+	 */
+	n = 0;
+	atoms = calloc(2 * clip->ntargets + 1, sizeof(*atoms));
+	names = calloc(2 * clip->ntargets + 1, sizeof(*names));
+	if (atoms == NULL || names == NULL)
+		goto done;
+	for (size_t i = 0; i < clip->ntargets; i++) {
+		atoms[n++] = clip->targets[i];
+		if (clip->contents[i].type != None)
+			atoms[n++] = clip->contents[i].type;
+	}
+	if (clip->utf8 != None)
+		atoms[n++] = clip->utf8;
+	if (!XGetAtomNames(display, atoms, n, names))
+		goto done;
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		goto done;
+	switch ((writer = fork())) {
+	case -1:
+		warn("fork");
+		break;
+	case 0:
+		/* the child has its own copy to decompress the payloads into */
+		for (size_t k = 0; k < clip->npayloads; k++)
+			if (!pack_thaw(clip, k))
+				_exit(EXIT_FAILURE);
+		if ((fd = mkstemp(tmp)) == -1)
+			_exit(EXIT_FAILURE);
+		if (writesnapshot(clip, names, n, fd) == -1 || rename(tmp, path) == -1) {
+			(void)unlink(tmp);
+			_exit(EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+done:
+	if (names != NULL)
+		for (size_t i = 0; i < n; i++)
+			XFree(names[i]);
+	free(names);
+	free(atoms);
+}
+
+void
+snapshot_reap(struct clipboard *clip)
+{
+	int status;
+
+	if (writer == -1 || waitpid(writer, &status, WNOHANG) <= 0)
+		return;
+	writer = -1;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		warnx("%s: could not save clipboard", path);
+	if (stale)
+		snapshot_save(clip);
+}
+
+struct clipboard *
+snapshot_load(void)
+{
+	struct clipboard *clip = NULL;
+	struct header header;
+	struct record *records = NULL;
+	struct extent *extents = NULL;
+	struct stat st;
+	char *names = NULL;
+	char **atomnames = NULL;
+	Atom *atoms = NULL;
+	size_t n, size, natoms = 0;
+	int fd;
+
+	if (path == NULL)
+		return NULL;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1)
+		goto error;
+	if (read(fd, &header, sizeof(header)) != sizeof(header))
+		goto error;
+	if (memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 ||
+	    header.longsize != sizeof(long) ||
+	    header.ntargets == 0 || header.npayloads > header.ntargets)
+		goto error;
+	n = header.ntargets;
+	records = calloc(n, sizeof(*records));
+	extents = calloc(header.npayloads + 1, sizeof(*extents));
+	names = malloc(header.namesize + 1);
+	atomnames = calloc(2 * n + 1, sizeof(*atomnames));
+	atoms = calloc(2 * n + 1, sizeof(*atoms));
+	if (records == NULL || extents == NULL || names == NULL ||
+	    atomnames == NULL || atoms == NULL)
+		goto error;
+	size = n * sizeof(*records);
+	if (read(fd, records, size) != (ssize_t)size)
+		goto error;
+	size = header.npayloads * sizeof(*extents);
+	if (read(fd, extents, size) != (ssize_t)size)
+		goto error;
+	if (read(fd, names, header.namesize) != (ssize_t)header.namesize)
+		goto error;
+	names[header.namesize] = '\0';
+
+	/* intern all names in a single round trip */
+	for (size_t i = 0; i < n; i++) {
+		if (records[i].name >= header.namesize)
+			goto error;
+		if (records[i].type != NONE && records[i].type >= header.namesize)
+			goto error;
+		if (records[i].payload != NONE && records[i].payload >= header.npayloads)
+			goto error;
+		atomnames[natoms++] = &names[records[i].name];
+		if (records[i].type != NONE)
+			atomnames[natoms++] = &names[records[i].type];
+	}
+	if (header.utf8 != NONE && header.utf8 >= header.namesize)
+		goto error;
+	if (header.utf8 != NONE)
+		atomnames[natoms++] = &names[header.utf8];
+	if (!XInternAtoms(display, atomnames, natoms, False, atoms))
+		goto error;
+
+	if ((clip = newclipboard(n)) == NULL)
+		goto error;
+	clip->utf8 = header.utf8 != NONE ? atoms[natoms - 1] : None;
+	clip->display = display;
+	for (size_t k = 0; k < header.npayloads; k++) {
+		struct extent *e = &extents[k];
+		void *p;
+		int dupfd;
+
+		if (e->offset % pagesize != 0 || e->size == 0 ||
+		    e->offset > (uint64_t)st.st_size ||
+		    e->size > (uint64_t)st.st_size - e->offset)
+			goto error;
+		if ((dupfd = dup(fd)) == -1)
+			goto error;
+		p = mmap(NULL, e->size, PROT_READ, MAP_SHARED, dupfd, e->offset);
+		if (p == MAP_FAILED) {
+			(void)close(dupfd);
+			goto error;
+		}
+		clip->payloads[clip->npayloads++] = (struct payload){
+			.data = p,
+			.size = e->size,
+			.hash = e->hash,
+			.fd = dupfd,
+			.offset = e->offset,
+		};
+		clip->nbytes += e->size;
+	}
+	natoms = 0;
+	for (size_t i = 0; i < n; i++) {
+		struct record *r = &records[i];
+		size_t unit = r->format == 32 ? sizeof(long) : r->format / 8;
+		void *data = NULL;
+
+		if (r->format != 8 && r->format != 16 && r->format != 32)
+			goto error;
+		if (r->payload != NONE) {
+			data = clip->payloads[r->payload].data;
+			if (r->length > clip->payloads[r->payload].size / unit)
+				goto error;
+		}
+		clip->targets[i] = atoms[natoms++];
+		clip->contents[i] = (struct ctrlsel){
+			.data = data,
+			.length = r->length,
+			.type = r->type != NONE ? atoms[natoms++] : None,
+			.format = r->format,
+		};
+		clip->ntargets++;
+	}
+	goto done;
+error:
+	warnx("%s: could not load clipboard", path);
+	freeclipboard(clip);
+	clip = NULL;
+done:
+	(void)close(fd);
+	free(records);
+	free(extents);
+	free(names);
+	free(atomnames);
+	free(atoms);
+	return clip;
+}
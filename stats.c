@@ -0,0 +1,104 @@
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+
+#include <control/selection.h>
+
+#include "util.h"
+#include "xclipd.h"
+
+#define PRINTCOUNTER(name, help) \
+	(void)fprintf(fp, "# HELP xclipd_%s_total %s\n", #name, help); \
+	(void)fprintf(fp, "# TYPE xclipd_%s_total counter\n", #name); \
+	(void)fprintf(fp, "xclipd_%s_total %lu\n", #name, stats.name);
+
+/*
+ * The counters are only updated and read from the main loop (the
+ * signal handler just raises a flag), so they need no locking.
+ */
+struct stats stats;
+
+void
+stats_add(struct histogram *histogram, unsigned long long value)
+{
+	size_t k;
+
+	/* bucket k counts the values up to 2^k; the last one, any */
+	for (k = 0; k + 1 < NBUCKETS && value > 1ULL << k; k++)
+		;
+	histogram->buckets[k]++;
+	histogram->count++;
+	histogram->sum += value;
+}
+
+static void
+printhistogram(FILE *fp, char const *name, char const *help,
+		struct histogram *histogram)
+{
+	unsigned long count = 0;
+
+	(void)fprintf(fp, "# HELP xclipd_%s %s\n", name, help);
+	(void)fprintf(fp, "# TYPE xclipd_%s histogram\n", name);
+	for (size_t k = 0; k + 1 < NBUCKETS; k++) {
+		count += histogram->buckets[k];
+		(void)fprintf(
+			fp, "xclipd_%s_bucket{le=\"%llu\"} %lu\n",
+			name, 1ULL << k, count
+		);
+	}
+	(void)fprintf(
+		fp, "xclipd_%s_bucket{le=\"+Inf\"} %lu\n",
+		name, histogram->count
+	);
+	(void)fprintf(fp, "xclipd_%s_sum %llu\n", name, histogram->sum);
+	(void)fprintf(fp, "xclipd_%s_count %lu\n", name, histogram->count);
+}
+
+static void
+printgauge(FILE *fp, char const *name, char const *help, size_t value)
+{
+	(void)fprintf(fp, "# HELP xclipd_%s %s\n", name, help);
+	(void)fprintf(fp, "# TYPE xclipd_%s gauge\n", name);
+	(void)fprintf(fp, "xclipd_%s %zu\n", name, value);
+}
+
+int
+stats_write(char const *path, size_t resident)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int fd;
+
+	/*
+	 * Rewrite the whole file in the Prometheus text format, and
+	 * rename it into place, so a scraper never sees it half done.
+	 */
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return -1;
+	if ((fd = mkstemp(tmp)) == -1)
+		return -1;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		(void)close(fd);
+		(void)unlink(tmp);
+		return -1;
+	}
+	COUNTERS(PRINTCOUNTER)
+	printgauge(fp, "resident_bytes", "bytes held by the clipboard and its history", resident);
+	printhistogram(fp, "fetch_milliseconds", "time to fetch a clipboard", &stats.fetchtime);
+	printhistogram(fp, "target_bytes", "size of fetched targets", &stats.targetsize);
+	if (fflush(fp) == EOF || ferror(fp)) {
+		(void)fclose(fp);
+		(void)unlink(tmp);
+		return -1;
+	}
+	if (fclose(fp) == EOF || rename(tmp, path) == -1) {
+		(void)unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -1,6 +1,17 @@
+#if __linux__
+#define _GNU_SOURCE     /* memfd_create(2) */
+#endif
+
+#include <sys/mman.h>
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
@@ -70,7 +81,7 @@ daemonize(void)
 }
 
 Display *
-xinit(void)
+xinit(char const *promises)
 {
 	Display *display;
 	char const *dpyname;
@@ -87,7 +98,7 @@ xinit(void)
 	 */
 	(void)XGetErrorDatabaseText(display, "XProtoError", "0", "", buf, 1);
 	(void)XSetErrorHandler(xerror);
-	epledge("stdio proc");
+	epledge(promises);
 	return display;
 }
 
@@ -133,3 +144,98 @@ getservertime(Display *display)
 	(void)XDestroyWindow(display, window);
 	return event.xproperty.time;
 }
+
+long long
+getmillis(void)
+{
+	struct timespec ts;
+
+	/* milliseconds on a clock that never jumps back */
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+socketpath(char *path, size_t size)
+{
+	char const *dir, *dpyname;
+	int n;
+
+	/* where xclipd answers local clients, one socket per display */
+	dpyname = XDisplayName(NULL);
+	if (dpyname == NULL || dpyname[0] == '\0')
+		return -1;
+	if ((dir = getenv("XDG_RUNTIME_DIR")) == NULL || dir[0] == '\0')
+		dir = "/tmp";
+	n = snprintf(
+		path, size, "%s/xclipd.%lu.%s",
+		dir, (unsigned long)getuid(), dpyname
+	);
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+	for (char *p = path + n - strlen(dpyname); *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';       /* as in launchd(8) display names */
+	return 0;
+}
+
+int
+writeall(int fd, void const *data, size_t size)
+{
+	char const *p = data;
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = write(fd, p, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+int
+spillfile(char const *name)
+{
+	char path[PATH_MAX];
+	char const *tmpdir;
+	int fd;
+
+	/*
+	 * Large payloads are kept in an anonymous file rather than
+	 * on the heap, so the kernel can page them out when memory
+	 * is needed elsewhere.
+	 */
+#if __linux__
+	if ((fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)) != -1)
+		return fd;
+#endif
+	if ((tmpdir = getenv("TMPDIR")) == NULL || tmpdir[0] == '\0')
+		tmpdir = "/tmp";
+	if (snprintf(path, sizeof(path), "%s/%s.XXXXXXXXXX", tmpdir, name) >= (int)sizeof(path))
+		return -1;
+	if ((fd = mkstemp(path)) == -1)
+		return -1;
+	(void)unlink(path);
+	return fd;
+}
+
+void *
+mapfile(int fd, size_t size)
+{
+	void *p;
+
+#if __linux__
+	/* nothing changes the data from now on, so clients can get the file */
+	(void)fcntl(
+		fd, F_ADD_SEALS,
+		F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL
+	);
+#endif
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
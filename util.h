@@ -3,7 +3,12 @@
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
 void daemonize(void);
-Display *xinit(void);
+Display *xinit(char const *promises);
 Window createwindow(Display *display);
 Atom getatom(Display *display, char const *atomname);
 Time getservertime(Display *display);
+long long getmillis(void);
+int socketpath(char *path, size_t size);
+int writeall(int fd, void const *data, size_t size);
+int spillfile(char const *name);
+void *mapfile(int fd, size_t size);
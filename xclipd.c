@@ -1,4 +1,12 @@
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -10,197 +18,1154 @@
 #include <control/selection.h>
 
 #include "util.h"
+#include "xclipd.h"
 
-#define ENUM(sym, str) sym,
-#define NAME(sym, str) (str==NULL?#sym:str),
-#define ATOMS(X) \
-	X(CLIPBOARD,		NULL) \
-	X(CLIPBOARD_MANAGER,	NULL) \
-	X(DELETE,		NULL) \
-	X(MULTIPLE,		NULL) \
-	X(SAVE_TARGETS,		NULL) \
-	X(TARGETS,		NULL) \
-	X(TEXT,			NULL) \
-	X(TIMESTAMP,		NULL) \
-	X(INSERT_PROPERTY,	NULL) \
-	X(INSERT_SELECTION,	NULL) \
-	X(UTF8_STRING,		NULL) \
-	X(STRING,		NULL) \
-	X(TEXT_PLAIN,		"text/plain") \
-	X(TEXT_PLAIN_UTF8,	"text/plain;charset=utf-8") \
-
-enum atoms {
-	ATOMS(ENUM)
-	NATOMS
-};
 
-struct clipboard {
-	struct ctrlsel *contents;
-	Atom *targets;
-	size_t ntargets;
+#define SETTLE 30       /* wait for the clipboard to settle for this milliseconds */
+#define MAXSETTLE 300   /* but for no longer than this milliseconds in all */
+#define DRAGSETTLE 300  /* wait for the primary selection to settle for this milliseconds */
+#define HISTSIZE 32     /* default size of the history, in megabytes */
+
+/*
+ * We may manage the clipboard of several displays at once.  Each
+ * one has a session, and the clipboard set on any of them is
+ * served on all of them.  The session whose events are being
+ * handled is the current one; its display and atoms are the ones
+ * the other modules use.
+ */
+struct session {
+	Display *display;
+	Atom atoms[NATOMS];
+	Window manager;
+	int xselection_event;
+	Time epoch;                     /* when we began serving the clipboard */
+	struct fetch fetch;             /* the clipboard being fetched */
+	Time pending;                   /* timestamp of a clipboard yet to fetch */
+	long long settle;               /* when to begin fetching it */
+	long long changed;              /* when the first change yet to fetch was made */
+	XSelectionRequestEvent saving;  /* SAVE_TARGETS yet to be replied */
+	Atom *targets;                  /* of a clipboard from another display */
+
+	/* the primary selection, kept apart when preserving it */
+	struct clipboard *primary;      /* text of the current owner, or NULL */
+	struct fetch primaryfetch;
+	Time primarypending;
+	long long primarysettle;
+	Time primaryepoch;
 };
 
-static Display *display;
-static Window manager;
-static Atom atomtab[NATOMS];
-static int xselection_event;
+Display *display;
+Atom *atomtab;
+
+static struct session *sessions;
+static size_t nsessions;
+static struct session *session;         /* the current session */
+static enum fetchmode mode = FETCH_ALL;
+static Bool preserve;           /* keep PRIMARY apart from CLIPBOARD */
+static struct clipboard *clip;  /* the clipboard being served */
+static struct fetch demand;     /* deferred targets fetched on request */
+static Atom *tried;             /* the targets it fetches */
+static size_t ntried;
+static struct waiting {
+	struct session *session;
+	XEvent event;
+} *waiting;                     /* requests waiting for them */
+static size_t nwaiting;
+static volatile sig_atomic_t dumpstats;
+static volatile sig_atomic_t reapchild;
+static int wakeup[2];           /* the signal handlers wake poll(2) through it */
+static char const *statsfile;
+
+static void
+awake(void)
+{
+	int saved = errno;
+
+	(void)write(wakeup[1], "", 1);
+	errno = saved;
+}
+
+static void
+sigusr1(int sig)
+{
+	(void)sig;
+	dumpstats = 1;
+	awake();
+}
+
+static void
+sigchld(int sig)
+{
+	(void)sig;
+	reapchild = 1;
+	awake();
+}
+
+static void
+enter(struct session *s)
+{
+	session = s;
+	display = s->display;
+	atomtab = s->atoms;
+}
+
+static struct session *
+origin(struct clipboard *clip)
+{
+	/* the session a clipboard has been fetched from */
+	for (size_t i = 0; clip != NULL && i < nsessions; i++)
+		if (sessions[i].display == clip->display)
+			return &sessions[i];
+	return &sessions[0];
+}
+
+static void
+report(void)
+{
+	size_t resident = history_size();
+
+	dumpstats = 0;
+	if (clip != NULL)
+		resident += clip->nbytes;
+	for (size_t i = 0; i < nsessions; i++)
+		if (sessions[i].primary != NULL)
+			resident += sessions[i].primary->nbytes;
+	if (statsfile != NULL) {
+		if (stats_write(statsfile, resident) == -1)
+			warn("%s", statsfile);
+		return;
+	}
+	warnx(
+		"%lu changes, %lu fetched, %lu unchanged, %lu skipped, "
+		"%lu cancelled, %lu stalled targets",
+		stats.changes, stats.fetched, stats.unchanged,
+		stats.skipped, stats.cancelled, stats.stalled
+	);
+}
+
+static void
+translate(struct session *s)
+{
+	struct session *from = origin(clip);
+	char **names = NULL;
+
+	/*
+	 * Another display is served the very same clipboard, with no
+	 * copy of its data; only its targets are interned there again,
+	 * by name, in a round trip to each display.
+	 */
+	free(s->targets);
+	s->targets = NULL;
+	if (s == from || clip->ntargets == 0)
+		return;
+	names = calloc(clip->ntargets, sizeof(*names));
+	s->targets = calloc(clip->ntargets, sizeof(*s->targets));
+	if (names == NULL || s->targets == NULL)
+		goto error;
+	if (!XGetAtomNames(from->display, clip->targets, clip->ntargets, names))
+		goto error;
+	if (!XInternAtoms(s->display, names, clip->ntargets, False, s->targets))
+		goto error;
+	goto done;
+error:
+	warnx("%s: could not translate targets", DisplayString(s->display));
+	free(s->targets);
+	s->targets = NULL;
+done:
+	for (size_t i = 0; names != NULL && i < clip->ntargets; i++)
+		XFree(names[i]);
+	free(names);
+}
+
+static Atom
+translatetype(Atom type, Atom target, size_t i, struct session *from)
+{
+	char *name;
+
+	/* the type is most often the target itself, or a known atom */
+	if (type == None || type <= XA_LAST_PREDEFINED)
+		return type;
+	if (type == target)
+		return session->targets[i];
+	for (size_t k = 0; k < NATOMS; k++)
+		if (from->atoms[k] == type)
+			return session->atoms[k];
+	if ((name = XGetAtomName(from->display, type)) == NULL)
+		return None;
+	type = XInternAtom(session->display, name, False);
+	XFree(name);
+	return type;
+}
 
 static int
 callback(void *arg, Atom target, struct ctrlsel *content)
 {
-	struct clipboard *clip = arg;
+	struct session *self = session;
+	struct session *from;
+	size_t i;
+	int found;
 
-	for (size_t i = 0; i < clip->ntargets; i++) {
-		if (target == clip->targets[i]) {
-			*content = clip->contents[i];
-			return True;
-		}
+	if (arg != clip || self->targets == NULL)
+		return lookupcontent(arg, target, content);
+
+	/* look the target up in the display the clipboard is from */
+	for (i = 0; i < clip->ntargets; i++)
+		if (self->targets[i] == target)
+			break;
+	if (i == clip->ntargets)
+		return 0;
+	from = origin(clip);
+	enter(from);
+	found = lookupcontent(arg, clip->targets[i], content);
+	enter(self);
+	if (found)
+		content->type = translatetype(content->type, clip->targets[i], i, from);
+	return found;
+}
+
+static Bool
+postpone(XEvent *event, Atom const *targets)
+{
+	XSelectionRequestEvent *xev = &event->xselectionrequest;
+	struct session *self = session;
+	struct waiting *p;
+	Atom *pairs = NULL, *wanted = NULL, *copy;
+	Atom const *requested = &xev->target;
+	Atom type;
+	unsigned long n = 1, remain, step = 1;
+	size_t nwanted = 0, i;
+	int format;
+
+	/*
+	 * A request for targets left with the owner waits for them to
+	 * be fetched, while the other requests are answered meanwhile.
+	 */
+	if (xev->target == atomtab[MULTIPLE]) {
+		if (xev->property == None || XGetWindowProperty(
+			display, xev->requestor, xev->property,
+			0, INT_MAX,
+			False,
+			atomtab[ATOM_PAIR], &type, &format,
+			&n, &remain, (void *)&pairs
+		) != Success || format != 32 || pairs == NULL)
+			goto done;
+		requested = pairs;
+		step = 2;
+	}
+	if ((wanted = calloc(n, sizeof(*wanted))) == NULL)
+		goto done;
+	for (unsigned long k = 0; k < n; k += step) {
+		for (i = 0; i < clip->ntargets; i++)
+			if (targets[i] == requested[k])
+				break;
+		if (i < clip->ntargets && isdeferred(clip, clip->targets[i]))
+			wanted[nwanted++] = clip->targets[i];
+	}
+	if (nwanted == 0)
+		goto done;
+	if (demand.requestor == None && XGetSelectionOwner(
+		origin(clip)->display, origin(clip)->atoms[CLIPBOARD]
+	) != clip->owner) {
+		nwanted = 0;    /* the targets are gone with their owner */
+		goto done;
+	}
+	if ((p = realloc(waiting, (nwaiting + 1) * sizeof(*waiting))) == NULL) {
+		nwanted = 0;
+		goto done;
 	}
-	return False;
+	waiting = p;
+	waiting[nwaiting++] = (struct waiting){ .session = self, .event = *event };
+	if (demand.requestor != None)
+		goto done;      /* answered when the running fetch is over */
+
+	/* the fetch filters the targets it is given, so give it a copy */
+	if ((copy = calloc(nwanted, sizeof(*copy))) == NULL)
+		goto done;
+	memcpy(copy, wanted, nwanted * sizeof(*copy));
+	tried = wanted;
+	ntried = nwanted;
+	wanted = NULL;
+	enter(origin(clip));
+	fetch_save(&demand, atomtab[CLIPBOARD], clip->acquired, copy, ntried);
+	enter(self);
+	free(copy);
+done:
+	free(wanted);
+	XFree(pairs);
+	return nwanted > 0;
 }
 
-static Time
-next_clipboard(Time epoch, struct clipboard *clip)
+static void
+answer(XEvent *event)
 {
-	XEvent event;
-	XFixesSelectionNotifyEvent *xselection = (void *)&event;
+	struct clipboard *from = clip;
+	Time epoch = session->epoch;
+	Atom *targets;
 	int error;
 
-	for (;;) switch (XNextEvent(display, &event), event.type) {
-	case SelectionRequest:
-		if (clip == NULL || clip->ntargets == 0)
-			continue;
-		if (event.xselectionrequest.owner != manager)
-			continue;
-		if (event.xselectionrequest.selection != atomtab[CLIPBOARD] &&
-		    event.xselectionrequest.selection != XA_PRIMARY)
-			continue;
-		error = -ctrlsel_answer(
-			&event, epoch,
-			clip->targets, clip->ntargets,
-			callback, clip
-		);
-		if (error) warnx(
+	if (event->xselectionrequest.owner != session->manager)
+		return;
+	if (event->xselectionrequest.selection == XA_PRIMARY &&
+	    session->primary != NULL) {
+		/* a preserved primary selection is only served where it is from */
+		from = session->primary;
+		epoch = session->primaryepoch;
+		targets = from->targets;
+	} else if (clip == NULL || clip->ntargets == 0) {
+		return;
+	} else if (event->xselectionrequest.selection != atomtab[CLIPBOARD] &&
+	    event->xselectionrequest.selection != XA_PRIMARY) {
+		return;
+	} else if ((targets = session->targets) == NULL) {
+		if (origin(clip) != session)
+			return;
+		targets = clip->targets;
+	}
+	if (from == clip && clip->owner != None && postpone(event, targets))
+		return;
+	error = -ctrlsel_answer(
+		event, epoch,
+		targets, from->ntargets,
+		callback, from
+	);
+	stats.requests++;
+	if (error) {
+		stats.errors++;
+		warnx(
 			"could not answer client 0x%08lX: %s",
-			event.xselectionrequest.requestor,
+			event->xselectionrequest.requestor,
 			strerror(error)
 		);
-		continue;
-	case SelectionClear:
-		if (event.xselectionclear.window != manager)
+	}
+}
+
+static void
+replay(void)
+{
+	struct session *self = session;
+	struct waiting *list = waiting;
+	size_t n = nwaiting;
+
+	/* the requests may wait again, for targets not fetched yet */
+	waiting = NULL;
+	nwaiting = 0;
+	for (size_t i = 0; i < n; i++) {
+		enter(list[i].session);
+		answer(&list[i].event);
+	}
+	free(list);
+	enter(self);
+}
+
+static void
+finishdemand(void)
+{
+	struct session *self = session;
+	struct clipboard *fetched;
+
+	enter(origin(clip));
+	fetched = fetch_end(&demand);
+	if (XGetSelectionOwner(display, atomtab[CLIPBOARD]) != clip->owner) {
+		/* the data is from whoever set the clipboard since */
+		freeclipboard(fetched);
+		fetched = NULL;
+	}
+	if (takedeferred(clip, fetched, tried, ntried))
+		for (size_t i = 0; i < nsessions; i++)
+			translate(&sessions[i]);
+	freeclipboard(fetched);
+	free(tried);
+	tried = NULL;
+	ntried = 0;
+	enter(self);
+	replay();
+}
+
+static void
+undefer(void)
+{
+	struct session *self = session;
+
+	/* the targets left with the owner are no longer fetched */
+	if (demand.requestor != None) {
+		enter(origin(clip));
+		freeclipboard(fetch_end(&demand));
+		enter(self);
+	}
+	free(tried);
+	tried = NULL;
+	ntried = 0;
+	dropdeferred(clip);
+	replay();
+}
+
+static void
+serve(struct clipboard *next, Time timestamp)
+{
+	struct session *self = session;
+	Time primary, when;
+
+	undefer();
+	history_push(clip);
+	clip = next;
+
+	/*
+	 * A clipboard whose owner still has some of its targets is
+	 * left with that owner, and only mirrored into PRIMARY (and
+	 * into the other displays).  The timestamp is only valid on
+	 * the current display.  A preserved PRIMARY is left alone.
+	 */
+	for (size_t i = 0; i < nsessions; i++) {
+		enter(&sessions[i]);
+		translate(session);
+		when = session == self ? timestamp : CurrentTime;
+		if (clip->owner == None || clip->display != display) {
+			session->epoch = ctrlsel_own(
+				display, session->manager, when, atomtab[CLIPBOARD]
+			);
+		}
+		if (preserve)
 			continue;
-		if (event.xselectionclear.selection == atomtab[CLIPBOARD_MANAGER])
-			return 0;
-		continue;
+		primary = ctrlsel_own(
+			display, session->manager, when, XA_PRIMARY
+		);
+		if (clip->owner != None && clip->display == display)
+			session->epoch = primary;
+	}
+	enter(origin(clip));
+	snapshot_save(clip);
+	enter(self);
+}
+
+static void
+adopt(Time timestamp)
+{
+	/* the owner is gone, and so are the targets left with it */
+	undefer();
+	if (clip->ntargets == 0)
+		return;
+	session->epoch = ctrlsel_own(
+		display, session->manager, timestamp, atomtab[CLIPBOARD]
+	);
+	for (size_t i = 0; i < nsessions; i++)
+		translate(&sessions[i]);
+	snapshot_save(clip);
+}
+
+static void
+saved(Bool success)
+{
+	XSelectionRequestEvent *saving = &session->saving;
+	Atom property = saving->property;
+
+	if (saving->requestor == None)
+		return;
+	if (property == None)
+		property = saving->target;      /* obsolete requestor */
+	if (success) {
+		/* the reply to SAVE_TARGETS is an empty NULL-typed property */
+		(void)XChangeProperty(
+			display, saving->requestor, property,
+			atomtab[NULLTYPE], 32, PropModeReplace, NULL, 0
+		);
+	}
+	(void)XSendEvent(
+		display, saving->requestor, False, NoEventMask,
+		(XEvent *)&(XSelectionEvent){
+			.type = SelectionNotify,
+			.display = display,
+			.requestor = saving->requestor,
+			.selection = saving->selection,
+			.target = saving->target,
+			.property = success ? property : None,
+			.time = saving->time,
+		}
+	);
+	saving->requestor = None;
+}
+
+static void
+cancel(void)
+{
+	freeclipboard(fetch_end(&session->fetch));
+	saved(False);
+}
+
+static void
+reclaim(Time timestamp)
+{
+	Window owner;
+
+	/*
+	 * The clipboard has been set again with the same data; keep
+	 * serving it as it is, without storing a copy in the history.
+	 */
+	stats.unchanged++;
+	if (clip->owner != None) {
+		if ((owner = XGetSelectionOwner(display, atomtab[CLIPBOARD])) == None)
+			adopt(timestamp);
+		else
+			clip->owner = owner;
+		return;
+	}
+	session->epoch = ctrlsel_own(
+		display, session->manager, timestamp, atomtab[CLIPBOARD]
+	);
+	if (!preserve) {
+		(void)ctrlsel_own(
+			display, session->manager, timestamp, XA_PRIMARY
+		);
+	}
+}
+
+static void
+publish(void)
+{
+	struct fetch *fetch = &session->fetch;
+	struct clipboard *next;
+	Time timestamp = fetch->timestamp;
+
+	/*
+	 * Swap the old clipboard for the fetched one only when it is
+	 * complete (or the owner has timed out), so requests are
+	 * answered from the old one in the meantime.
+	 */
+	if ((next = fetch_end(fetch)) == NULL) {
+		if (fetch->unchanged && clip != NULL)
+			reclaim(timestamp);
+		saved(False);
+		return;
+	}
+	stats.fetched++;
+	stats_add(&stats.fetchtime, getmillis() - fetch->started);
+	serve(next, timestamp);
+	saved(True);
+}
+
+static void
+save(XEvent *event)
+{
+	XSelectionRequestEvent *xev = &event->xselectionrequest;
+	struct fetch *fetch = &session->fetch;
+	unsigned long length = 0, remain;
+	Atom *targets = NULL;
+	Atom type;
+	int format;
+
+	/*
+	 * An exiting owner asks us to save the clipboard, in the
+	 * targets listed on the property (or in all of them), and
+	 * waits for our reply.  Its clipboard is fetched at once, in
+	 * place of any fetch for it that is running or yet to begin.
+	 */
+	if (xev->property != None && (XGetWindowProperty(
+		display, xev->requestor, xev->property,
+		0, INT_MAX,
+		False,
+		XA_ATOM, &type, &format,
+		&length, &remain, (void *)&targets
+	) != Success || format != 32 || type != XA_ATOM)) {
+		XFree(targets);
+		targets = NULL;
+	}
+	if (fetch->requestor != None)
+		cancel();
+	session->pending = CurrentTime;
+	session->saving = *xev;
+	if (targets == NULL || length == 0) {
+		XFree(targets);
+		fetch_start(fetch, atomtab[CLIPBOARD], xev->time, FETCH_ALL, NULL);
+	} else {
+		fetch_save(fetch, atomtab[CLIPBOARD], xev->time, targets, length);
+		XFree(targets);
+		if (fetch->npending == 0) {
+			publish();
+		}
+	}
+}
+
+static void
+forget(void)
+{
+	if (session->primaryfetch.requestor != None)
+		freeclipboard(fetch_end(&session->primaryfetch));
+	freeclipboard(session->primary);
+	session->primary = NULL;
+	session->primarypending = CurrentTime;
+}
+
+static void
+restore(long index, Time timestamp)
+{
+	struct session *self = session;
+	struct clipboard *next;
+
+	if (index < 1 || (next = history_take(index - 1)) == NULL) {
+		warnx("%ld: no such clipboard in history", index);
+		return;
+	}
+	for (size_t i = 0; i < nsessions; i++) {
+		enter(&sessions[i]);
+		if (session->fetch.requestor != None)
+			cancel();
+		session->pending = CurrentTime;
+	}
+	enter(self);
+	serve(next, timestamp);
+	if (!preserve)
+		return;
+
+	/* a clipboard brought back goes into PRIMARY all the same */
+	for (size_t i = 0; i < nsessions; i++) {
+		enter(&sessions[i]);
+		forget();
+		(void)ctrlsel_own(
+			display, session->manager,
+			session == self ? timestamp : CurrentTime, XA_PRIMARY
+		);
+	}
+	enter(self);
+}
+
+static void
+track(XFixesSelectionNotifyEvent *xselection)
+{
+	/*
+	 * Dragging the mouse over some text may set PRIMARY dozens of
+	 * times a second.  Only fetch its text once it has settled,
+	 * and only take it over when its owner closes, so the owner
+	 * keeps its selection highlighted in the meantime.
+	 */
+	if (xselection->owner == session->manager)
+		return;
+	if (xselection->owner != None) {
+		stats.selected++;
+		forget();
+		session->primarypending = xselection->timestamp;
+		session->primarysettle = getmillis() + DRAGSETTLE;
+		return;
+	}
+	if (xselection->subtype == XFixesSetSelectionOwnerNotify ||
+	    session->primary == NULL) {
+		/* cleared on purpose, or closed before it was fetched */
+		forget();
+		return;
+	}
+	stats.preserved++;
+	session->primaryepoch = ctrlsel_own(
+		display, session->manager, xselection->timestamp, XA_PRIMARY
+	);
+}
+
+static Bool
+handle(XEvent *event)
+{
+	XFixesSelectionNotifyEvent *xselection = (void *)event;
+
+	/* large targets being sent in chunks */
+	if (ctrlsel_send(event))
+		return True;
+	if (demand.requestor != None && session == origin(clip) &&
+	    fetch_event(&demand, event)) {
+		if (demand.npending == 0)
+			finishdemand();
+		return True;
+	}
+	if (session->fetch.requestor != None && fetch_event(&session->fetch, event)) {
+		if (session->fetch.npending == 0)
+			publish();
+		return True;
+	}
+	if (session->primaryfetch.requestor != None &&
+	    fetch_event(&session->primaryfetch, event)) {
+		if (session->primaryfetch.npending == 0)
+			session->primary = fetch_end(&session->primaryfetch);
+		return True;
+	}
+	switch (event->type) {
+	case SelectionRequest:
+		if (event->xselectionrequest.selection == atomtab[CLIPBOARD_MANAGER] &&
+		    event->xselectionrequest.target == atomtab[SAVE_TARGETS])
+			save(event);
+		else
+			answer(event);
+		break;
+	case SelectionClear:
+		if (event->xselectionclear.window != session->manager)
+			break;
+		if (event->xselectionclear.selection == atomtab[CLIPBOARD_MANAGER])
+			return False;
+		break;
 	case DestroyNotify:
-		if (event.xdestroywindow.window == manager)
-			return 0;
-		continue;
+		if (event->xdestroywindow.window == session->manager)
+			return False;
+		break;
+	case ClientMessage:
+		if (event->xclient.window != session->manager)
+			break;
+		if (event->xclient.message_type != atomtab[XCLIPD_RESTORE])
+			break;
+		restore(event->xclient.data.l[0], event->xclient.data.l[1]);
+		break;
 	default:
-		if (event.type != xselection_event)
-			continue;
+		if (event->type != session->xselection_event)
+			break;
+		if (xselection->selection == XA_PRIMARY) {
+			track(xselection);
+			break;
+		}
 		if (xselection->selection != atomtab[CLIPBOARD])
-			continue;
-		if (xselection->owner == manager || xselection->owner == None)
-			continue;
-		return xselection->timestamp;
+			break;
+		if (xselection->owner == None && clip != NULL &&
+		    clip->owner != None && clip->display == display)
+			adopt(xselection->timestamp);
+		if (xselection->owner == session->manager || xselection->owner == None)
+			break;
+
+		/*
+		 * Programs may set the clipboard several times in a
+		 * row; only fetch the last one, after it has settled,
+		 * or after a while if it keeps changing.
+		 */
+		stats.changes++;
+		if (session->fetch.requestor != None) {
+			cancel();
+			stats.cancelled++;
+		} else if (session->pending != CurrentTime) {
+			stats.skipped++;
+		}
+		if (session->pending == CurrentTime)
+			session->changed = getmillis();
+		session->pending = xselection->timestamp;
+		session->settle = MIN(
+			getmillis() + SETTLE,
+			session->changed + MAXSETTLE
+		);
+		break;
 	}
-	return 0;
+	return True;
 }
 
-static size_t
-gettargets(Time timestamp, Atom **targets)
+static long long
+tickprimary(void)
 {
-	struct ctrlsel content = { 0 };
+	struct fetch *fetch = &session->primaryfetch;
+	long long timeout = -1;
 
-	if (ctrlsel_request(
-		display, timestamp, atomtab[CLIPBOARD],
-		atomtab[TARGETS], &content
-	) > 0 && content.format == 32 && content.type == XA_ATOM) {
-		*targets = content.data;
-		return content.length;
+	if (fetch->requestor != None) {
+		if ((timeout = fetch->deadline - getmillis()) <= 0) {
+			stats.stalled += fetch_expire(fetch);
+			if (fetch->npending == 0)
+				session->primary = fetch_end(fetch);
+			return 0;
+		}
+	} else if (session->primarypending != CurrentTime) {
+		if ((timeout = session->primarysettle - getmillis()) <= 0) {
+			fetch_start(
+				fetch, XA_PRIMARY, session->primarypending,
+				FETCH_TEXT, NULL
+			);
+			session->primarypending = CurrentTime;
+			return 0;
+		}
 	}
-	XFree(content.data);
-	*targets = NULL;
+	return timeout;
+}
+
+static long long
+tickdemand(void)
+{
+	long long timeout;
+
+	if (demand.requestor == None)
+		return -1;
+	if (demand.npending > 0 && (timeout = demand.deadline - getmillis()) > 0)
+		return timeout;
+	stats.stalled += fetch_expire(&demand);
+	if (demand.npending == 0)
+		finishdemand();
 	return 0;
 }
 
-int
-main(void)
+static long long
+tick(void)
+{
+	struct fetch *fetch = &session->fetch;
+	long long timeout = -1;
+
+	/* return how long to wait for, or 0 if something was done */
+	if (fetch->requestor != None) {
+		/* publish whatever has arrived from a silent owner */
+		if ((timeout = fetch->deadline - getmillis()) <= 0) {
+			stats.stalled += fetch_expire(fetch);
+			if (fetch->npending == 0)
+				publish();
+			return 0;
+		}
+	} else if (session->pending != CurrentTime) {
+		if ((timeout = session->settle - getmillis()) <= 0) {
+			/* a clipboard from another display is never unchanged */
+			fetch_start(
+				fetch, atomtab[CLIPBOARD], session->pending, mode,
+				clip != NULL && clip->display == display ? clip : NULL
+			);
+			session->pending = CurrentTime;
+			return 0;
+		}
+	}
+	return timeout;
+}
+
+static struct clipboard *
+current(void)
+{
+	struct session *s;
+
+	/* local clients only get a clipboard known to be the current one */
+	if (clip == NULL || clip->owner != None)
+		return NULL;
+	for (size_t i = 0; i < nsessions; i++)
+		if (sessions[i].fetch.requestor != None ||
+		    sessions[i].pending != CurrentTime)
+			return NULL;
+	s = origin(clip);
+	if (XGetSelectionOwner(s->display, s->atoms[CLIPBOARD]) != s->manager)
+		return NULL;
+
+	/* the local clients' atoms are the clipboard's own */
+	enter(s);
+	return clip;
+}
+
+static Time
+attach(void)
 {
-	char *atomnames[] = { ATOMS(NAME) };
 	Time timestamp;
-	struct ctrlsel *buf = NULL;
 
-	display = xinit();
-	manager = createwindow(display);
-	if (!XInternAtoms(display, atomnames, NATOMS, False, atomtab))
-		errx(EXIT_FAILURE, "could not intern atoms");
+	session->manager = createwindow(display);
 	if (XGetSelectionOwner(display, atomtab[CLIPBOARD_MANAGER]) != None)
-		errx(EXIT_FAILURE, "there's already another clipboard manager running");
-	timestamp = ctrlsel_own(display, manager, CurrentTime, atomtab[CLIPBOARD_MANAGER]);
+		errx(EXIT_FAILURE, "%s: there's already another clipboard manager running",
+		    DisplayString(display));
+	timestamp = ctrlsel_own(display, session->manager, CurrentTime, atomtab[CLIPBOARD_MANAGER]);
 	if (timestamp == 0)
-		errx(EXIT_FAILURE, "could not own clipboard manager");
-	if (!XFixesQueryExtension(display, &xselection_event, (int[]){0}))
-		errx(EXIT_FAILURE, "could not use XFixes");
-	xselection_event += XFixesSelectionNotify;
+		errx(EXIT_FAILURE, "%s: could not own clipboard manager",
+		    DisplayString(display));
+	if (!XFixesQueryExtension(display, &session->xselection_event, (int[]){0}))
+		errx(EXIT_FAILURE, "%s: could not use XFixes", DisplayString(display));
+	session->xselection_event += XFixesSelectionNotify;
 	XFixesSelectSelectionInput(
-		display, manager, atomtab[CLIPBOARD],
-		XFixesSetSelectionOwnerNotifyMask
+		display, session->manager, atomtab[CLIPBOARD],
+		XFixesSetSelectionOwnerNotifyMask | (mode == FETCH_LAZY ?
+			XFixesSelectionWindowDestroyNotifyMask |
+			XFixesSelectionClientCloseNotifyMask : 0)
 	);
+	session->primarypending = CurrentTime;
+	if (preserve) {
+		XFixesSelectSelectionInput(
+			display, session->manager, XA_PRIMARY,
+			XFixesSetSelectionOwnerNotifyMask |
+			XFixesSelectionWindowDestroyNotifyMask |
+			XFixesSelectionClientCloseNotifyMask
+		);
+		if (XGetSelectionOwner(display, XA_PRIMARY) != None) {
+			session->primarypending = timestamp;
+			session->primarysettle = getmillis();
+		}
+	}
+	return timestamp;
+}
 
-	do {
-		size_t n;
-		Time epoch;
-		struct clipboard clip;
-
-		n = gettargets(timestamp, &clip.targets);
-		for (size_t i = clip.ntargets = 0; i < n; i++) {
-			/* discard meta-targets */
-			if (clip.targets[i] == atomtab[TARGETS] ||
-			    clip.targets[i] == atomtab[MULTIPLE] ||
-			    clip.targets[i] == atomtab[TIMESTAMP] ||
-			    clip.targets[i] == atomtab[DELETE] ||
-			    clip.targets[i] == atomtab[INSERT_PROPERTY] ||
-			    clip.targets[i] == atomtab[INSERT_SELECTION])
-				continue;
-			clip.targets[clip.ntargets++] = clip.targets[i];
-		}
-
-		clip.contents = NULL;
-		if (clip.ntargets > 0) {
-			clip.contents = reallocarray(buf, clip.ntargets, sizeof(*buf));
-		}
-		if (clip.contents == NULL) {
-			XFree(clip.targets);
-			timestamp = next_clipboard(0, NULL);
-			continue;
+static int
+sendrestore(long index)
+{
+	Window owner;
+
+	owner = XGetSelectionOwner(display, atomtab[CLIPBOARD_MANAGER]);
+	if (owner == None)
+		errx(EXIT_FAILURE, "there's no clipboard manager running");
+	(void)XSendEvent(
+		display, owner, False, NoEventMask,
+		(XEvent *)&(XClientMessageEvent){
+			.type = ClientMessage,
+			.window = owner,
+			.message_type = atomtab[XCLIPD_RESTORE],
+			.format = 32,
+			.data.l = { index, getservertime(display) },
 		}
-		buf = clip.contents;
+	);
+	XCloseDisplay(display);
+	return EXIT_SUCCESS;
+}
+
+static size_t
+getnum(char const *s, Bool scaled)
+{
+	unsigned long long n, unit = 1;
+	char *end;
 
-		for (size_t i = 0; i < clip.ntargets; i++) {
-			clip.contents[i].data = NULL;
-			(void)ctrlsel_request(
-				display, timestamp, atomtab[CLIPBOARD],
-				clip.targets[i], &clip.contents[i]
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (scaled && *end != '\0') switch (*end++) {
+	case 'G': case 'g':
+		unit <<= 10;
+		/* FALLTHROUGH */
+	case 'M': case 'm':
+		unit <<= 10;
+		/* FALLTHROUGH */
+	case 'K': case 'k':
+		unit <<= 10;
+		break;
+	default:
+		end = "";
+		errno = EINVAL;
+	}
+	if (errno != 0 || end == s || *end != '\0' || n > SIZE_MAX / unit)
+		errx(EXIT_FAILURE, "%s: invalid number", s);
+	return n * unit;
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr, "usage: xclipd [-lp] [-a pattern] [-D display] [-d pattern] [-f file]\n");
+	(void)fprintf(stderr, "              [-M size] [-m size] [-n count] [-S file] [-s size] [-z size]\n");
+	(void)fprintf(stderr, "       xclipd -r index\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *atomnames[] = { ATOMS(NAME) };
+	char **dpynames;
+	XEvent event;
+	Time timestamp;
+	struct pollfd *pfds;
+	long long timeout, t;
+	size_t histcount = 0;
+	size_t histsize = (size_t)HISTSIZE << 20;
+	long index = 0;
+	int ch;
+
+	/* the display in $DISPLAY is the first one, at sessions[0] */
+	nsessions = 1;
+	if ((dpynames = calloc(argc + 1, sizeof(*dpynames))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	while ((ch = getopt(argc, argv, "a:D:d:f:lM:m:n:pr:S:s:z:")) != -1) switch (ch) {
+	case 'a':
+		policy_pattern(optarg, True);
+		break;
+	case 'D':
+		dpynames[nsessions++] = optarg;
+		break;
+	case 'd':
+		policy_pattern(optarg, False);
+		break;
+	case 'f':
+		snapshot_init(optarg);
+		break;
+	case 'l':
+		mode = FETCH_LAZY;
+		break;
+	case 'M':
+		maxclipboard = getnum(optarg, True);
+		break;
+	case 'm':
+		maxtarget = getnum(optarg, True);
+		break;
+	case 'n':
+		histcount = getnum(optarg, False);
+		break;
+	case 'p':
+		preserve = True;
+		break;
+	case 'r':
+		index = getnum(optarg, False);
+		if (index < 1)
+			errx(EXIT_FAILURE, "%s: invalid index", optarg);
+		break;
+	case 'S':
+		statsfile = optarg;
+		break;
+	case 's':
+		histsize = getnum(optarg, True);
+		break;
+	case 'z':
+		packsize = MAX(getnum(optarg, True), 1);
+		break;
+	default:
+		usage();
+	}
+	if (optind < argc)
+		usage();
+	textlocale = setlocale(LC_CTYPE, "") != NULL && XSupportsLocale();
+	if (index > 0)
+		nsessions = 1;
+	sessions = calloc(nsessions, sizeof(*sessions));
+	pfds = calloc(nsessions + QUERYFDS + 1, sizeof(*pfds));
+	if (sessions == NULL || pfds == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	/* the other displays are opened before xinit() drops privileges */
+	for (size_t i = 1; i < nsessions; i++)
+		if ((sessions[i].display = XOpenDisplay(dpynames[i])) == NULL)
+			errx(EXIT_FAILURE, "%s: could not open display", dpynames[i]);
+	free(dpynames);
+	sessions[0].display = xinit("stdio rpath wpath cpath proc unix sendfd");
+	for (size_t i = 0; i < nsessions; i++) {
+		enter(&sessions[i]);
+		if (!XInternAtoms(display, atomnames, NATOMS, False, atomtab))
+			errx(EXIT_FAILURE, "could not intern atoms");
+	}
+	enter(&sessions[0]);
+	if (index > 0)
+		return sendrestore(index);
+	history_init(histcount, histsize);
+	timestamp = attach();
+	(void)query_init();
+
+	/* a signal caught right before poll(2) must not be left unseen */
+	if (pipe(wakeup) == -1)
+		err(EXIT_FAILURE, "pipe");
+	for (size_t i = 0; i < 2; i++) {
+		(void)fcntl(wakeup[i], F_SETFD, FD_CLOEXEC);
+		(void)fcntl(wakeup[i], F_SETFL, O_NONBLOCK);
+	}
+	if (sigaction(SIGUSR1, &(struct sigaction){
+		.sa_handler = sigusr1,
+	}, NULL) == -1)
+		err(EXIT_FAILURE, "sigaction");
+	if (sigaction(SIGCHLD, &(struct sigaction){
+		.sa_handler = sigchld,
+		.sa_flags = SA_NOCLDSTOP,
+	}, NULL) == -1)
+		err(EXIT_FAILURE, "sigaction");
+
+	/*
+	 * Serve the clipboard saved by a previous run right away,
+	 * unless some client has already set a new one.  The other
+	 * displays get that clipboard too, unless they have their own.
+	 */
+	if (XGetSelectionOwner(display, atomtab[CLIPBOARD]) == None &&
+	    (clip = snapshot_load()) != NULL) {
+		session->epoch = ctrlsel_own(
+			display, session->manager, timestamp, atomtab[CLIPBOARD]
+		);
+		if (!preserve && XGetSelectionOwner(display, XA_PRIMARY) == None) {
+			(void)ctrlsel_own(
+				display, session->manager, timestamp, XA_PRIMARY
 			);
 		}
+	} else {
+		fetch_start(&session->fetch, atomtab[CLIPBOARD], timestamp, mode, NULL);
+	}
+	for (size_t i = 1; i < nsessions; i++) {
+		enter(&sessions[i]);
+		timestamp = attach();
+		if (clip != NULL && XGetSelectionOwner(display, atomtab[CLIPBOARD]) == None) {
+			translate(session);
+			session->epoch = ctrlsel_own(
+				display, session->manager, timestamp, atomtab[CLIPBOARD]
+			);
+		} else {
+			fetch_start(&session->fetch, atomtab[CLIPBOARD], timestamp, mode, NULL);
+		}
+	}
+	for (;;) {
+		/* saving the snapshot again may read events, handled next */
+		if (reapchild) {
+			reapchild = 0;
+			enter(origin(clip));
+			snapshot_reap(clip);
+		}
+		for (size_t i = 0; i < nsessions; i++) {
+			enter(&sessions[i]);
+			while (XPending(display) > 0) {
+				(void)XNextEvent(display, &event);
+				if (!handle(&event))
+					goto done;
+			}
+		}
+		if (dumpstats)
+			report();
+		timeout = -1;
+		for (size_t i = 0; i < nsessions; i++) {
+			enter(&sessions[i]);
+			if ((t = tick()) >= 0 && (timeout < 0 || t < timeout))
+				timeout = t;
+			if ((t = tickprimary()) >= 0 && (timeout < 0 || t < timeout))
+				timeout = t;
+		}
+		if ((t = tickdemand()) >= 0 && (timeout < 0 || t < timeout))
+			timeout = t;
 
-		epoch = ctrlsel_own(
-			display, manager, timestamp, atomtab[CLIPBOARD]
-		);
-		(void)ctrlsel_own(
-			display, manager, timestamp, XA_PRIMARY
-		);
+		/* compress cold targets when there is nothing else to do */
+		if (timeout != 0 && (t = pack_clipboard(clip)) >= 0 &&
+		    (timeout < 0 || t < timeout))
+			timeout = t;
+		if (timeout != 0 && (t = history_pack()) >= 0 &&
+		    (timeout < 0 || t < timeout))
+			timeout = t;
 
-		timestamp = next_clipboard(epoch, &clip);
-		XFree(clip.targets);
-		for (size_t i = 0; i < clip.ntargets; i++) {
-			XFree(clip.contents[i].data);
+		/*
+		 * Round trips made while handling a display (owning the
+		 * selections, translating targets) read events into the
+		 * queues of the others, which poll(2) would not see.
+		 */
+		for (size_t i = 0; i < nsessions; i++) {
+			if (XEventsQueued(sessions[i].display, QueuedAlready) > 0)
+				timeout = 0;
+			XFlush(sessions[i].display);
 		}
-	} while (timestamp != 0);
-	free(buf);
-	XDestroyWindow(display, manager);
-	XCloseDisplay(display);
+		for (size_t i = 0; i < nsessions; i++) {
+			pfds[i] = (struct pollfd){
+				.fd = XConnectionNumber(sessions[i].display),
+				.events = POLLIN,
+			};
+		}
+		if ((t = query_poll(pfds + nsessions)) >= 0 &&
+		    (timeout < 0 || t < timeout))
+			timeout = t;
+		pfds[nsessions + QUERYFDS] = (struct pollfd){
+			.fd = wakeup[0],
+			.events = POLLIN,
+		};
+		if (poll(pfds, nsessions + QUERYFDS + 1, timeout) == -1) {
+			if (errno != EINTR)
+				err(EXIT_FAILURE, "poll");
+			continue;
+		}
+		if (pfds[nsessions + QUERYFDS].revents & POLLIN)
+			while (read(wakeup[0], &(char){ 0 }, 1) == 1)
+				;
+		query_answer(pfds + nsessions, current);
+	}
+done:
+	if (demand.requestor != None) {
+		enter(origin(clip));
+		freeclipboard(fetch_end(&demand));
+	}
+	free(tried);
+	free(waiting);
+	for (size_t i = 0; i < nsessions; i++) {
+		enter(&sessions[i]);
+		if (session->fetch.requestor != None)
+			cancel();
+		forget();
+	}
+	freeclipboard(clip);
+	history_free();
+	pool_free();
+	policy_free();
+	query_free();
+	for (size_t i = 0; i < nsessions; i++) {
+		free(sessions[i].targets);
+		XDestroyWindow(sessions[i].display, sessions[i].manager);
+		XCloseDisplay(sessions[i].display);
+	}
+	free(sessions);
+	free(pfds);
+	(void)close(wakeup[0]);
+	(void)close(wakeup[1]);
 	return EXIT_FAILURE;
 }
@@ -0,0 +1,213 @@
+#define ENUM(sym, str, meta) sym,
+#define NAME(sym, str, meta) (str==NULL?#sym:str),
+#define META(sym, str, meta) meta,
+#define ATOMS(X) \
+	X(ATOM_PAIR,		NULL,				False) \
+	X(CLIPBOARD,		NULL,				False) \
+	X(CLIPBOARD_MANAGER,	NULL,				False) \
+	X(DELETE,		NULL,				True) \
+	X(INCR,			NULL,				False) \
+	X(MULTIPLE,		NULL,				True) \
+	X(SAVE_TARGETS,		NULL,				True) \
+	X(TARGETS,		NULL,				True) \
+	X(TEXT,			NULL,				False) \
+	X(TIMESTAMP,		NULL,				True) \
+	X(INSERT_PROPERTY,	NULL,				True) \
+	X(INSERT_SELECTION,	NULL,				True) \
+	X(UTF8_STRING,		NULL,				False) \
+	X(STRING,		NULL,				False) \
+	X(TEXT_PLAIN,		"text/plain",			False) \
+	X(TEXT_PLAIN_UTF8,	"text/plain;charset=utf-8",	False) \
+	X(COMPOUND_TEXT,	NULL,				False) \
+	X(NULLTYPE,		"NULL",				False) \
+	X(XCLIPD_RESTORE,	"_XCLIPD_RESTORE",		False) \
+
+#define FIELD(name, help) unsigned long name;
+#define COUNTERS(X) \
+	X(changes,	"clipboard ownership changes seen") \
+	X(fetched,	"clipboards fetched and served") \
+	X(unchanged,	"clipboards set again with the same data") \
+	X(skipped,	"clipboards superseded before being fetched") \
+	X(cancelled,	"clipboards superseded while being fetched") \
+	X(stalled,	"targets given up on for their owner being silent") \
+	X(failed,	"targets that could not be fetched") \
+	X(incr,		"targets fetched by INCR transfers") \
+	X(requests,	"selection requests answered") \
+	X(errors,	"selection requests that could not be answered") \
+	X(allocated,	"buffers allocated rather than reused from the pool") \
+	X(selected,	"PRIMARY ownership changes seen") \
+	X(packed,	"targets compressed once cold") \
+	X(unpacked,	"compressed targets read again") \
+	X(preserved,	"PRIMARY selections kept after their owner closed") \
+
+#define HASHINIT 0xCBF29CE484222325ULL
+#define NBUCKETS 32
+
+enum atoms {
+	ATOMS(ENUM)
+	NATOMS
+};
+
+enum fetchmode {
+	FETCH_ALL,
+	FETCH_LAZY,                     /* leave the other targets with the owner */
+	FETCH_TEXT,                     /* drop the other targets */
+};
+
+struct payload {
+	void *data;
+	size_t size;                    /* in bytes */
+	uint64_t hash;
+	int fd;                         /* file data is mapped from, or -1 */
+	uint64_t offset;                /* of the data in the file */
+	void *packed;                   /* compressed data, or NULL */
+	size_t packedsize;
+	long long used;                 /* when last read */
+	Bool dense;                     /* not worth compressing */
+};
+
+struct clipboard {
+	struct ctrlsel *contents;       /* data points into the payloads */
+	struct payload *payloads;       /* distinct data, shared by contents */
+	size_t npayloads;
+	size_t *links;                  /* payload of each compressed content, plus one */
+	Atom *targets;
+	size_t ntargets;
+	Atom utf8;                      /* text the legacy targets derive from */
+	size_t nbytes;                  /* size of all payloads, as kept */
+	Display *display;               /* whose atoms the targets are */
+	Window owner;                   /* still has the deferred targets, or None */
+	Time acquired;                  /* when the owner set the selection */
+	size_t *slots;                  /* hash index of targets, or NULL */
+	size_t nslots;
+	uint64_t targetshash;           /* of the targets as listed by the owner */
+	uint64_t texthash;              /* of the UTF-8 text */
+	size_t size;                    /* of the block holding it and its arrays */
+};
+
+struct fetch {
+	/*
+	 * A fetch first converts the selection into TARGETS, and then
+	 * into all the listed targets at once, either with a single
+	 * MULTIPLE request or with one ConvertSelection request per
+	 * target.  The converted data is collected as the events
+	 * arrive from the main loop, so answering requests is never
+	 * blocked by a fetch.
+	 */
+	struct clipboard *clip;         /* NULL while waiting for TARGETS */
+	struct incoming {
+		enum {
+			CONVERTING,     /* waiting for SelectionNotify */
+			RECEIVING,      /* in an INCR transfer */
+			DEFERRED,       /* left with the owner until requested */
+			HELD,           /* until the text is found to differ */
+			DONE,
+		} state;
+		size_t capacity;        /* of the INCR buffer, in bytes */
+		uint64_t hash;          /* of the data received so far */
+		int fd;                 /* where a large INCR transfer goes */
+		long long deadline;     /* when to give up on the target */
+	} *incoming;
+	size_t npending;
+	size_t nbytes;                  /* received so far */
+	long long deadline;             /* of the target to give up first */
+	long long expiry;               /* when to give up on all targets */
+	long long started;
+	Window requestor;               /* None when not fetching */
+	Atom selection;
+	Time timestamp;
+	Bool batch;                     /* the owner supports MULTIPLE */
+	Bool multiple;                  /* converting with a MULTIPLE request */
+	enum fetchmode mode;            /* which targets to fetch */
+	Bool verifying;                 /* fetching the text first to compare */
+	Bool unchanged;                 /* same as the served clipboard */
+	uint64_t targetshash;           /* of the served clipboard */
+	uint64_t texthash;
+};
+
+struct histogram {
+	unsigned long buckets[NBUCKETS];        /* by powers of two */
+	unsigned long count;
+	unsigned long long sum;
+};
+
+struct stats {
+	COUNTERS(FIELD)
+	struct histogram fetchtime;     /* in milliseconds */
+	struct histogram targetsize;    /* in bytes */
+};
+
+/* xclipd.c */
+extern Display *display;
+extern Atom *atomtab;
+
+/* clipboard.c */
+uint64_t hashdata(uint64_t hash, void const *data, size_t size);
+void freedata(void *data, size_t size, int fd);
+struct clipboard *newclipboard(size_t ntargets);
+void *addpayload(struct clipboard *clip, void *data, size_t size,
+		uint64_t hash, int fd);
+extern Bool textlocale;
+Bool ismeta(Atom target);
+Bool isderived(Atom target);
+Bool isessential(Atom target);
+void dropdeferred(struct clipboard *clip);
+Bool isdeferred(struct clipboard *clip, Atom target);
+Bool takedeferred(struct clipboard *clip, struct clipboard *fetched,
+		Atom const *tried, size_t ntried);
+Bool lookupcontent(struct clipboard *clip, Atom target, struct ctrlsel *content);
+void freeclipboard(struct clipboard *clip);
+
+/* pool.c */
+void *pool_get(size_t *size);
+void pool_put(void *data, size_t size);
+void pool_free(void);
+
+/* pack.c */
+extern size_t packsize;
+Bool pack_thaw(struct clipboard *clip, size_t k);
+void pack_touch(struct clipboard *clip, void const *data);
+long long pack_clipboard(struct clipboard *clip);
+
+/* stats.c */
+extern struct stats stats;
+void stats_add(struct histogram *histogram, unsigned long long value);
+int stats_write(char const *path, size_t resident);
+
+/* history.c */
+void history_init(size_t count, size_t size);
+size_t history_size(void);
+void history_push(struct clipboard *clip);
+struct clipboard *history_take(size_t index);
+long long history_pack(void);
+void history_free(void);
+
+/* snapshot.c */
+void snapshot_init(char const *file);
+void snapshot_save(struct clipboard *clip);
+void snapshot_reap(struct clipboard *clip);
+struct clipboard *snapshot_load(void);
+
+/* policy.c */
+extern size_t maxtarget;
+extern size_t maxclipboard;
+void policy_pattern(char const *glob, Bool allow);
+size_t policy_admit(Atom *targets, size_t ntargets);
+void policy_free(void);
+
+/* query.c */
+#define QUERYFDS 17     /* the socket, and the clients served at once */
+struct pollfd;
+int query_init(void);
+long long query_poll(struct pollfd *pfds);
+void query_answer(struct pollfd const *pfds, struct clipboard *(*current)(void));
+void query_free(void);
+
+/* fetch.c */
+void fetch_start(struct fetch *fetch, Atom selection, Time timestamp,
+		enum fetchmode mode, struct clipboard const *served);
+void fetch_save(struct fetch *fetch, Atom selection, Time timestamp,
+		Atom *targets, size_t ntargets);
+Bool fetch_event(struct fetch *fetch, XEvent *event);
+size_t fetch_expire(struct fetch *fetch);
+struct clipboard *fetch_end(struct fetch *fetch);
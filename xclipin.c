@@ -1,8 +1,14 @@
+#if __linux__
+#define _GNU_SOURCE     /* splice(2) */
+#endif
+
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,106 +21,533 @@
 
 #include "util.h"
 
+#define CHUNK   (64 << 10)      /* read the input in chunks of this bytes */
+#define TIMEOUT 10000           /* give up on a requestor silent for this milliseconds */
+#define SPLICE  (1 << 20)       /* move at most this bytes at once from a pipe */
+#define MAXTARGETS 32           /* optimist maximum */
+
+struct input {
+	char const *data;       /* all of the input, once read */
+	size_t size;            /* read so far */
+	int fd;                 /* still being read, or -1 */
+	int spill;              /* keeps what has been read, or -1 */
+};
+
+struct transfer {
+	/*
+	 * Data still being read, or too large for a single property,
+	 * is sent in an INCR transfer: a chunk each time the requestor
+	 * deletes the property, as long as there is input for it.
+	 * Each requestor has its own transfer, driven by its own
+	 * PropertyNotify events, so a slow one delays no other.
+	 */
+	struct transfer *next;
+	struct input *input;
+	Window requestor;
+	Atom property;
+	Atom type;
+	size_t offset;          /* of the next chunk */
+	long long deadline;     /* when to give up on the requestor */
+	Bool waiting;           /* for more input */
+};
+
+static Display *display;
+static size_t maxsize;          /* of the data in a single property */
+static struct transfer *transfers;
+static Bool streaming;
+static Bool mapped;             /* each target has its own input, and type */
+static Atom incr;
+
+/* each target is answered from its own input */
+static Atom targets[MAXTARGETS];
+static Atom types[MAXTARGETS];
+static struct input *sources[MAXTARGETS];
+static size_t ntargets;
+
 static int
 callback(void *arg, Atom target, struct ctrlsel *content)
 {
-	(void)target;
-	*content = *(struct ctrlsel *)arg;
-	return 1;
+	(void)arg;
+	for (size_t i = 0; i < ntargets; i++) {
+		if (targets[i] != target)
+			continue;
+		*content = (struct ctrlsel){
+			.data = (void *)sources[i]->data,
+			.length = sources[i]->size,
+			.format = 8,
+			.type = types[i],
+		};
+		return content->data != NULL;
+	}
+	return 0;
+}
+
+static ssize_t
+fill(int fd, int spill)
+{
+	static char buf[CHUNK];
+	ssize_t n;
+
+	/*
+	 * A pipe is spliced into the spill file, so its data is not
+	 * copied through our memory, and the file grows with no
+	 * reallocation.  Anything else is read and written.
+	 */
+#if __linux__
+	static Bool nosplice;
+
+	if (!nosplice) {
+		n = splice(fd, NULL, spill, NULL, SPLICE, SPLICE_F_MOVE);
+		if (n != -1 || (errno != EINVAL && errno != ENOSYS))
+			return n;
+		nosplice = True;
+	}
+#endif
+	if ((n = read(fd, buf, sizeof(buf))) > 0 && writeall(spill, buf, n) == -1)
+		err(EXIT_FAILURE, "write");
+	return n;
+}
+
+static void
+readinput(struct input *in)
+{
+	ssize_t n;
+
+	/* what is read is kept in the spill file, for later requests */
+	if ((n = fill(in->fd, in->spill)) == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		err(EXIT_FAILURE, "read");
+	}
+	if (n > 0) {
+		in->size += n;
+		return;
+	}
+	(void)close(in->fd);
+	in->fd = -1;
+	if (in->size > 0 && (in->data = mapfile(in->spill, in->size)) == NULL)
+		err(EXIT_FAILURE, "mmap");
+}
+
+static void
+notify(XSelectionRequestEvent const *xev, Atom property)
+{
+	(void)XSendEvent(
+		display, xev->requestor, False, NoEventMask,
+		(XEvent *)&(XSelectionEvent){
+			.type = SelectionNotify,
+			.display = display,
+			.requestor = xev->requestor,
+			.selection = xev->selection,
+			.target = xev->target,
+			.property = property,
+			.time = xev->time,
+		}
+	);
+}
+
+static void
+begin(struct input *in, XSelectionRequestEvent const *xev, Atom type)
+{
+	struct transfer *transfer;
+	Atom property = xev->property;
+
+	if (property == None)
+		property = xev->target;         /* obsolete requestor */
+	if ((transfer = malloc(sizeof(*transfer))) == NULL) {
+		notify(xev, None);
+		return;
+	}
+	*transfer = (struct transfer){
+		.next = transfers,
+		.input = in,
+		.requestor = xev->requestor,
+		.property = property,
+		.type = type,
+		.offset = 0,
+		.deadline = getmillis() + TIMEOUT,
+		.waiting = False,
+	};
+	transfers = transfer;
+
+	/* the size told is a lower bound, as the input may still grow */
+	XSelectInput(display, xev->requestor, PropertyChangeMask | StructureNotifyMask);
+	(void)XChangeProperty(
+		display, xev->requestor, property,
+		incr, 32, PropModeReplace,
+		(void *)&(long){ in->size }, 1
+	);
+	notify(xev, property);
+}
+
+static void
+end(struct transfer **p)
+{
+	struct transfer *transfer = *p;
+
+	/*
+	 * The events selected on the requestor are left as they are,
+	 * for ctrlsel(3) may be sending it the targets of a MULTIPLE
+	 * request over the same window.
+	 */
+	*p = transfer->next;
+	free(transfer);
+}
+
+static void
+watch(Window requestor)
+{
+	/* ctrlsel(3) restores the requestor's events when it is done */
+	for (struct transfer *t = transfers; t != NULL; t = t->next) {
+		if (t->requestor == requestor) {
+			XSelectInput(display, requestor, PropertyChangeMask | StructureNotifyMask);
+			return;
+		}
+	}
+}
+
+static void
+forget(Window requestor)
+{
+	struct transfer **p = &transfers;
+
+	/* the requestor is gone, and so are its transfers */
+	while (*p != NULL) {
+		if ((*p)->requestor == requestor)
+			end(p);
+		else
+			p = &(*p)->next;
+	}
+}
+
+static Bool
+sendchunk(struct transfer *transfer)
+{
+	struct input *in = transfer->input;
+	size_t size = MIN(maxsize, in->size - transfer->offset);
+	size_t skew = 0;
+	char *map = NULL;
+
+	/* return whether the transfer is over */
+	if (size == 0 && in->fd != -1) {
+		transfer->waiting = True;
+		return False;
+	}
+	if (in->data == NULL && size > 0) {
+		/* map the chunk from the input read so far */
+		skew = transfer->offset % sysconf(_SC_PAGESIZE);
+		map = mmap(
+			NULL, size + skew, PROT_READ, MAP_SHARED,
+			in->spill, transfer->offset - skew
+		);
+		if (map == MAP_FAILED)
+			err(EXIT_FAILURE, "mmap");
+	}
+	(void)XChangeProperty(
+		display, transfer->requestor, transfer->property,
+		transfer->type, 8, PropModeReplace,
+		(void *)(map != NULL ? map + skew : in->data + transfer->offset),
+		size
+	);
+	if (map != NULL)
+		(void)munmap(map, size + skew);
+	transfer->offset += size;
+	transfer->deadline = getmillis() + TIMEOUT;
+	transfer->waiting = False;
+	return size == 0;       /* a zero-length chunk ends it */
+}
+
+static void
+progress(XPropertyEvent const *xev)
+{
+	struct transfer **p;
+
+	if (xev->state != PropertyDelete)
+		return;
+	for (p = &transfers; *p != NULL; p = &(*p)->next)
+		if ((*p)->requestor == xev->window && (*p)->property == xev->atom)
+			break;
+	if (*p == NULL || (*p)->waiting)
+		return;
+	if (sendchunk(*p))
+		end(p);
+}
+
+static long long
+resume(void)
+{
+	struct transfer **p = &transfers;
+	long long now = getmillis();
+	long long timeout = -1;
+
+	/*
+	 * Send the new input to the requestors waiting for it, give up
+	 * on the silent ones, and return how long to wait for them.
+	 */
+	while (*p != NULL) {
+		if ((*p)->waiting ? sendchunk(*p) : (*p)->deadline <= now) {
+			end(p);
+			continue;
+		}
+		if (!(*p)->waiting && (timeout < 0 || (*p)->deadline - now < timeout))
+			timeout = (*p)->deadline - now;
+		p = &(*p)->next;
+	}
+	return timeout;
+}
+
+static size_t
+getmaxsize(void)
+{
+	long units;
+
+	/*
+	 * The largest data a ChangeProperty request can carry, whose
+	 * header is one unit longer when it is a BIG-REQUESTS one.
+	 * Data that fits is sent at once, the rest in chunks this big.
+	 */
+	if ((units = XExtendedMaxRequestSize(display)) > 0)
+		return units * 4 - 28;
+	return XMaxRequestSize(display) * 4 - 24;
 }
 
 static void
-send_clip(char * const targetnames[], char const *data, size_t size)
+send_clip(char * const names[], struct input * const inputs[], size_t n, struct input *stream)
 {
-	Display *display;
 	Window owner;
 	XEvent event;
+	XSelectionRequestEvent *xev;
 	Atom selection;
 	Atom polymorphic_type, string_type;
-	Atom targets[32];       /* optimist maximum */
 	Time epoch;
-	size_t ntargets;
+	size_t i;
+	struct pollfd pfds[2];
+	long long timeout;
+	Bool owned = True;
 	int error;
 
-	display = xinit();
+	display = xinit("stdio proc");
 	selection = getatom(display, SELECTION);
-	if (size < 1) {
+
+	/* targets whose input is empty are not offered */
+	for (i = 0; i < n; i++) {
+		if (inputs[i]->size < 1 && inputs[i]->fd == -1)
+			continue;
+		targets[ntargets] = getatom(display, names[i]);
+		sources[ntargets++] = inputs[i];
+	}
+	if (ntargets == 0) {
 		ctrlsel_own(display, None, CurrentTime, selection);
 		XCloseDisplay(display);
 		return;
 	}
 	owner = createwindow(display);
-	for (ntargets = 0; ntargets < LEN(targets) && targetnames[ntargets] != NULL; ntargets++)
-		targets[ntargets] = getatom(display, targetnames[ntargets]);
 	polymorphic_type = getatom(display, "TEXT");
 	string_type = getatom(display, "STRING");
-	if (ntargets == 0) {
-		targets[ntargets++] = getatom(display, "UTF8_STRING");
-		targets[ntargets++] = string_type;
-		targets[ntargets++] = polymorphic_type;
-		targets[ntargets++] = getatom(display, "COMPOUND_TEXT");
+	incr = getatom(display, "INCR");
+	maxsize = getmaxsize();
+	for (i = 0; i < ntargets; i++) {
+		types[i] = mapped ? targets[i] : targets[0];
+		if (types[i] == polymorphic_type)
+			types[i] = string_type;
 	}
 	if ((epoch = ctrlsel_own(display, owner, CurrentTime, selection)) == 0)
 		errx(EXIT_FAILURE, "could not own selection");
 	daemonize();
-	while (!XNextEvent(display, &event)) switch (event.type) {
-	case SelectionClear:
-		if (event.xselectionclear.window == owner)
-			return;
-		continue;
-	case DestroyNotify:
-		if (event.xdestroywindow.window == owner)
-			return;
-		continue;
-	case SelectionRequest:
-		if (event.xselectionrequest.selection != selection)
-			continue;
-		error = -ctrlsel_answer(
-			&event, epoch, targets, ntargets,
-			callback, (void *)&(struct ctrlsel){
-				.data = (void *)data,
-				.length = size,
-				.format = 8,
-				.type = targets[0] == polymorphic_type
-					? string_type : targets[0],
+	for (;;) {
+		while (XPending(display) > 0) {
+			(void)XNextEvent(display, &event);
+
+			/* large targets of MULTIPLE requests sent in chunks */
+			if (ctrlsel_send(&event)) {
+				watch(event.xproperty.window);
+				continue;
 			}
-		);
-		if (error)
-			warnx("could not request selection: %s", strerror(error));
-		continue;
+			switch (event.type) {
+			case SelectionClear:
+				/* finish the transfers in progress first */
+				if (event.xselectionclear.window == owner)
+					owned = False;
+				continue;
+			case DestroyNotify:
+				if (event.xdestroywindow.window == owner)
+					goto done;
+				forget(event.xdestroywindow.window);
+				continue;
+			case PropertyNotify:
+				progress(&event.xproperty);
+				continue;
+			case SelectionRequest:
+				break;
+			default:
+				continue;
+			}
+			xev = &event.xselectionrequest;
+			if (xev->selection != selection)
+				continue;
+			if (!owned) {
+				notify(xev, None);
+				continue;
+			}
+			for (i = 0; i < ntargets; i++)
+				if (targets[i] == xev->target)
+					break;
+
+			/*
+			 * Data still arriving or too large for a property is
+			 * sent over INCR, alongside any other transfer;
+			 * everything else is answered at once.
+			 */
+			if (i < ntargets &&
+			    (xev->time == CurrentTime || xev->time >= epoch) &&
+			    (sources[i]->fd != -1 || sources[i]->size > maxsize)) {
+				begin(sources[i], xev, types[i]);
+				continue;
+			}
+			error = -ctrlsel_answer(
+				&event, epoch, targets, ntargets,
+				callback, NULL
+			);
+			if (error)
+				warnx("could not request selection: %s", strerror(error));
+		}
+		timeout = resume();
+		if (!owned && transfers == NULL)
+			goto done;
+		XFlush(display);        /* the chunks resume() has just queued */
+		pfds[0] = (struct pollfd){
+			.fd = XConnectionNumber(display),
+			.events = POLLIN,
+		};
+		pfds[1] = (struct pollfd){
+			.fd = stream->fd,       /* ignored when -1 */
+			.events = POLLIN,
+		};
+		if (poll(pfds, 2, timeout) == -1) {
+			if (errno != EINTR)
+				err(EXIT_FAILURE, "poll");
+			continue;
+		}
+		if (pfds[1].revents == 0)
+			continue;
+		readinput(stream);
+		if (stream->fd != -1 || stream->size > 0)
+			continue;
+		for (i = 0; i < ntargets && sources[i] == stream; i++)
+			;
+		if (i == ntargets) {
+			/* the only input was empty after all */
+			if (owned)
+				(void)ctrlsel_own(display, None, CurrentTime, selection);
+			goto done;
+		}
 	}
+done:
+	while (transfers != NULL)
+		end(&transfers);
 	XDestroyWindow(display, owner);
 	XCloseDisplay(display);
 }
 
-int
-main(int argc, char *argv[])
+static void
+openinput(struct input *in, int fd, Bool stream)
 {
 	struct stat stat;
-	FILE *stream;
-	char buf[BUFSIZ];
 	char *data;
-	ssize_t nread;
-	size_t size;
 
-	(void)argc;
-	if (fstat(STDIN_FILENO, &stat) == -1)
+	*in = (struct input){ .fd = -1, .spill = -1 };
+	if (fstat(fd, &stat) == -1)
 		err(EXIT_FAILURE, "stat");
-	data = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+	data = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (data != MAP_FAILED) {
-		send_clip(argv+1, data, stat.st_size);
-		munmap(data, stat.st_size);
-	} else {
-		stream = open_memstream(&data, &size);
-		while ((nread = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
-			if (nread == -1)
-				err(EXIT_FAILURE, "read");
-			if ((ssize_t)fwrite(buf, 1, nread, stream) != nread)
-				err(EXIT_FAILURE, "fwrite");
+		in->data = data;
+		in->size = stat.st_size;
+		(void)close(fd);
+		return;
+	}
+
+	/*
+	 * Any other input is kept in an anonymous file, mapped
+	 * read-only once it is all read, just like a regular file.
+	 * When streaming, the selection is owned right away, and
+	 * the input is read as it comes.
+	 */
+	if ((in->spill = spillfile("xclipin")) == -1)
+		err(EXIT_FAILURE, "could not create spill file");
+	in->fd = fd;
+	while (!stream && in->fd != -1)
+		readinput(in);
+}
+
+static void
+closeinput(struct input *in)
+{
+	if (in->data != NULL)
+		(void)munmap((void *)in->data, in->size);
+	if (in->spill != -1)
+		(void)close(in->spill);
+}
+
+static void
+usage(char const *progname)
+{
+	(void)fprintf(stderr, "usage: %s [-s] [target[=file] ...]\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char *defaults[] = { "UTF8_STRING", "STRING", "TEXT", "COMPOUND_TEXT", NULL };
+	struct input in = { .fd = -1, .spill = -1 };
+	struct input files[MAXTARGETS];
+	struct input *inputs[MAXTARGETS];
+	char *names[MAXTARGETS];
+	char *path;
+	size_t n, nfiles = 0;
+	Bool usestdin = False;
+	int ch, fd;
+
+	while ((ch = getopt(argc, argv, "s")) != -1) switch (ch) {
+	case 's':
+		streaming = True;
+		break;
+	default:
+		usage(argv[0]);
+	}
+	argv += optind;
+	if (*argv == NULL)
+		argv = defaults;
+
+	/*
+	 * A target may be given as target=file, to be answered from the
+	 * file rather than from the standard input ("-"), so several
+	 * representations of the same data are owned at once.
+	 */
+	for (n = 0; n < MAXTARGETS && *argv != NULL; n++, argv++) {
+		names[n] = *argv;
+		inputs[n] = &in;
+		if ((path = strchr(*argv, '=')) == NULL) {
+			usestdin = True;
+			continue;
+		}
+		*path++ = '\0';
+		mapped = True;
+		if (strcmp(path, "-") == 0) {
+			usestdin = True;
+			continue;
 		}
-		(void)fclose(stream);
-		send_clip(argv+1, data, size);
-		free(data);
+		if ((fd = open(path, O_RDONLY)) == -1)
+			err(EXIT_FAILURE, "%s", path);
+		openinput(&files[nfiles], fd, False);
+		inputs[n] = &files[nfiles++];
 	}
+	if (usestdin)
+		openinput(&in, STDIN_FILENO, streaming);
+	send_clip(names, inputs, n, &in);
+	if (usestdin)
+		closeinput(&in);
+	for (size_t i = 0; i < nfiles; i++)
+		closeinput(&files[i]);
 	return EXIT_SUCCESS;
 }
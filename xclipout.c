@@ -1,7 +1,13 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
 #include <err.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
@@ -11,6 +17,118 @@
 
 #include "util.h"
 
+static int
+receive(int sock, char *buf, size_t size, size_t *len, int *fd)
+{
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	ssize_t n;
+
+	msg.msg_iov = &(struct iovec){
+		.iov_base = buf + *len,
+		.iov_len = size - *len,
+	};
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if ((n = recvmsg(sock, &msg, 0)) <= 0)
+		return -1;
+	*len += n;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+	return 0;
+}
+
+static int
+fromdaemon(char **requests)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	unsigned long long size, offset;
+	char buf[BUFSIZ];
+	char *data, *nl;
+	size_t len = 0;
+	ssize_t n;
+	int sock, fd = -1;
+	void *p;
+
+	/*
+	 * Ask the running xclipd, which has the clipboard at hand,
+	 * before asking the X server; see query.c.
+	 */
+	if (strcmp(SELECTION, "CLIPBOARD") != 0)
+		return -1;
+	if (socketpath(addr.sun_path, sizeof(addr.sun_path)) == -1)
+		return -1;
+	if (lstat(addr.sun_path, &st) == -1 ||
+	    !S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+		return -1;
+	for (int i = 0; requests[i] != NULL; i++) {
+		size = strlen(requests[i]);
+		if (size == 0 || strchr(requests[i], '\n') != NULL)
+			continue;
+		if (size + 2 > sizeof(buf) - len)
+			return -1;
+		memcpy(buf + len, requests[i], size);
+		len += size;
+		buf[len++] = '\n';
+	}
+	buf[len++] = '\n';
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    send(sock, buf, len, MSG_NOSIGNAL) != (ssize_t)len) {
+		(void)close(sock);
+		return -1;
+	}
+	for (len = 0; (nl = memchr(buf, '\n', len)) == NULL; ) {
+		if (len == sizeof(buf) || receive(sock, buf, sizeof(buf), &len, &fd) == -1) {
+			(void)close(sock);
+			return -1;     /* not answered; ask the X server */
+		}
+	}
+	*nl = '\0';
+	data = nl + 1;
+	len -= data - buf;
+	if (fd != -1 && sscanf(buf, "%llu %llu", &size, &offset) == 2) {
+		/* the data is in a file we can map in */
+		(void)close(sock);
+		p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, offset);
+		if (p == MAP_FAILED)
+			err(EXIT_FAILURE, "mmap");
+		if (fwrite(p, 1, size, stdout) != size)
+			warn(NULL);
+		(void)munmap(p, size);
+		(void)close(fd);
+		return EXIT_SUCCESS;
+	}
+	if (sscanf(buf, "%llu", &size) != 1)
+		errx(EXIT_FAILURE, "xclipd: invalid answer");
+	while (size > 0) {
+		if (len == 0) {
+			if ((n = read(sock, buf, MIN(size, sizeof(buf)))) == -1)
+				err(EXIT_FAILURE, "read");
+			if (n == 0)
+				errx(EXIT_FAILURE, "xclipd: truncated answer");
+			data = buf;
+			len = n;
+		}
+		len = MIN(len, size);
+		if (fwrite(data, 1, len, stdout) != len)
+			warn(NULL);
+		size -= len;
+		len = 0;
+	}
+	(void)close(sock);
+	return EXIT_SUCCESS;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -25,7 +143,9 @@ main(int argc, char *argv[])
 
 	if (argc > 1)
 		requests = argv + 1;
-	display = xinit();
+	if (fromdaemon(requests) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
+	display = xinit("stdio proc");
 	selection = getatom(display, SELECTION);
 	timestamp = getservertime(display);
 	if (timestamp == 0)
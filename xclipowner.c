@@ -22,7 +22,7 @@ main(void)
 	Window owner;
 	int status;
 
-	display = xinit();
+	display = xinit("stdio proc");
 	selection = getatom(display, SELECTION);
 	timestamp = getservertime(display);
 	if (timestamp == 0)
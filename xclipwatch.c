@@ -21,7 +21,7 @@ main(void)
 	XFixesSelectionNotifyEvent *xselection = (void *)&event;
 	static int xselection_event;
 
-	display = xinit();
+	display = xinit("stdio proc");
 	selection = getatom(display, SELECTION);
 	manager_atm = getatom(display, "CLIPBOARD_MANAGER");
 	targets_atm = getatom(display, "TARGETS");